@@ -16,13 +16,32 @@ You should have received a copy of the GNU General Public License
 along with this program; If not, see <https://www.gnu.org/licenses/>
 */
 
+#include <obs.h>
 #include <util/platform.h>
+#include "obs-ssp.h"
 #include "VFrameQueue.h"
-#include <QDebug>
+#include <ssp_connector_nal.h>
 
 VFrameQueue::VFrameQueue()
+	: head(0),
+	  tail(0),
+	  sleeping(false),
+	  running(false),
+	  gop(0),
+	  refused(0)
 {
+	drained = 0;
 	maxTime = 0;
+	overflowed = false;
+	overflows = 0;
+	droppedNonRef = 0;
+	droppedToKeyframe = 0;
+	os_event_init(&wakeup, OS_EVENT_TYPE_AUTO);
+}
+
+VFrameQueue::~VFrameQueue()
+{
+	os_event_destroy(wakeup);
 }
 
 void VFrameQueue::start()
@@ -34,8 +53,22 @@ void VFrameQueue::start()
 void VFrameQueue::stop()
 {
 	running = false;
-	sem.release();
+	os_event_signal(wakeup);
 	pthread_join(thread, nullptr);
+
+	uint32_t h = head.load(std::memory_order_relaxed);
+	uint32_t t = tail.load(std::memory_order_acquire);
+	while (h != t) {
+		ring[h & (VFRAME_QUEUE_SIZE - 1)].buffer->release();
+		++h;
+	}
+	head.store(h, std::memory_order_release);
+	ssp_blog(LOG_INFO,
+		 "frame queue stopped, overflows: %llu, dropped non-reference: "
+		 "%llu, skipped to keyframe: %llu",
+		 (unsigned long long)overflows,
+		 (unsigned long long)droppedNonRef,
+		 (unsigned long long)droppedToKeyframe);
 }
 
 void VFrameQueue::setFrameCallback(VFrameQueue::CallbackFunc cb)
@@ -43,19 +76,96 @@ void VFrameQueue::setFrameCallback(VFrameQueue::CallbackFunc cb)
 	callback = std::move(cb);
 }
 
+void VFrameQueue::setDrainCallback(VFrameQueue::DrainFunc cb)
+{
+	drainCallback = std::move(cb);
+}
+
 void VFrameQueue::setFrameTime(uint64_t time_us)
 {
 	maxTime = time_us;
 }
 
-void VFrameQueue::enqueue(imf::SspH264Data data, uint64_t time_us, bool noDrop)
+void VFrameQueue::setVideoMeta(uint32_t gop)
+{
+	this->gop = gop;
+}
+
+void VFrameQueue::enqueue(VideoData *data, SSPBuffer *buffer, uint64_t time_us)
+{
+	uint32_t flags = data->flags;
+	uint32_t t = tail.load(std::memory_order_relaxed);
+	bool refuse = false;
+	if (overflowed && !(flags & SSP_NAL_FLAG_KEYFRAME)) {
+		// frames were lost, nothing decodes cleanly before the next IDR
+		refuse = true;
+	} else if (t - head.load(std::memory_order_acquire) ==
+		   VFRAME_QUEUE_SIZE) {
+		// the decoder is hopelessly behind, the frame is dropped
+		++overflows;
+		overflowed = true;
+		refuse = true;
+	}
+	if (refuse) {
+		if (!drainCallback) {
+			return;
+		}
+		// the sender must get the credit back even if nothing is queued
+		refused.fetch_add(1, std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_seq_cst)) {
+			os_event_signal(wakeup);
+		}
+		return;
+	}
+	overflowed = false;
+
+	// the frame is handed over by reference, not copied
+	buffer->addRef();
+	ring[t & (VFRAME_QUEUE_SIZE - 1)] = {data, buffer, time_us, flags};
+	tail.store(t + 1, std::memory_order_seq_cst);
+
+	if (sleeping.load(std::memory_order_seq_cst)) {
+		os_event_signal(wakeup);
+	}
+}
+
+/* Called by the consumer only. Credits are returned in batches, and all of
+ * them before it goes to sleep so the sender never starves on a partial
+ * batch. */
+void VFrameQueue::returnCredits(bool flush)
+{
+	if (!drainCallback) {
+		return;
+	}
+	drained += refused.exchange(0, std::memory_order_relaxed);
+	if (drained && (flush || drained >= VFRAME_CREDIT_BATCH)) {
+		drainCallback(drained);
+		drained = 0;
+	}
+}
+
+bool VFrameQueue::dequeue(Frame *frame)
 {
-	QMutexLocker locker(&queueLock);
-	uint8_t *copy_data = (uint8_t *)malloc(data.len);
-	memcpy(copy_data, data.data, data.len);
-	data.data = copy_data;
-	frameQueue.enqueue({data, time_us, noDrop});
-	sem.release();
+	uint32_t h = head.load(std::memory_order_relaxed);
+	// stop() releases what is left, nothing more is output after it
+	if (!running) {
+		return false;
+	}
+	while (h == tail.load(std::memory_order_acquire)) {
+		if (!running) {
+			return false;
+		}
+		returnCredits(true);
+		sleeping.store(true, std::memory_order_seq_cst);
+		if (h == tail.load(std::memory_order_seq_cst) &&
+		    !refused.load(std::memory_order_seq_cst) && running) {
+			os_event_wait(wakeup);
+		}
+		sleeping.store(false, std::memory_order_relaxed);
+	}
+	*frame = ring[h & (VFRAME_QUEUE_SIZE - 1)];
+	head.store(h + 1, std::memory_order_release);
+	return true;
 }
 
 void *VFrameQueue::pthread_run(void *q)
@@ -64,51 +174,68 @@ void *VFrameQueue::pthread_run(void *q)
 	return nullptr;
 }
 
+/* A reference frame cannot be dropped on its own, the only clean way to catch
+ * up is to drop everything up to the next IDR. That is worth it when the
+ * backlog is already large, or when the IDR is closer than the backlog. */
+bool VFrameQueue::skipToKeyframe(uint32_t sinceKeyframe)
+{
+	uint32_t backlog = tail.load(std::memory_order_acquire) -
+			   head.load(std::memory_order_relaxed);
+	if (backlog >= VFRAME_BACKLOG_SKIP) {
+		return true;
+	}
+	uint32_t g = gop;
+	return g && sinceKeyframe < g && g - sinceKeyframe <= backlog;
+}
+
 void VFrameQueue::run(VFrameQueue *q)
 {
 	Frame current;
 	uint64_t lastFrameTime = 0, lastStartTime = 0, processingTime = 0;
-	q->sem.acquire();
-	q->queueLock.lock();
-	if (q->frameQueue.empty()) {
-		q->queueLock.unlock();
-		return;
-	}
-	current = q->frameQueue.dequeue();
-	q->queueLock.unlock();
-	lastStartTime = os_gettime_ns() / 1000;
-	q->callback(&current.data);
-	lastFrameTime = current.time;
-	processingTime = os_gettime_ns() / 1000 - lastStartTime;
-	free((void *)current.data.data);
-	while (q->running) {
-		q->sem.acquire();
-		q->queueLock.lock();
-		if (q->frameQueue.empty()) {
-			q->queueLock.unlock();
-			continue;
+	uint32_t sinceKeyframe = 0;
+	bool first = true, waitKeyframe = false;
+
+	while (q->dequeue(&current)) {
+		bool keyframe = current.flags & SSP_NAL_FLAG_KEYFRAME;
+		bool reference = current.flags & SSP_NAL_FLAG_REFERENCE;
+		bool decode = true;
+
+		if (keyframe) {
+			waitKeyframe = false;
+			sinceKeyframe = 0;
+		} else {
+			++sinceKeyframe;
 		}
-		current = q->frameQueue.dequeue();
-		q->queueLock.unlock();
-		if (current.time < lastFrameTime) {
-			free((void *)current.data.data);
-			continue;
+
+		if (first || keyframe) {
+			decode = true;
+		} else if (waitKeyframe) {
+			decode = false;
+			q->droppedToKeyframe++;
+		} else if (current.time < lastFrameTime ||
+			   current.time - lastFrameTime + 15000 <=
+				   processingTime) {
+			// late: drop what nobody references, else resync at IDR
+			decode = false;
+			if (!reference) {
+				q->droppedNonRef++;
+			} else if (q->skipToKeyframe(sinceKeyframe)) {
+				waitKeyframe = true;
+				q->droppedToKeyframe++;
+			} else {
+				decode = true;
+			}
 		}
-		if (current.noDrop) {
-			lastStartTime = os_gettime_ns() / 1000;
-			q->callback(&current.data);
-			lastFrameTime = current.time;
-			processingTime = os_gettime_ns() / 1000 - lastStartTime;
-		} else if (current.time - lastFrameTime + 15000 >
-			   processingTime) {
+
+		if (decode) {
 			lastStartTime = os_gettime_ns() / 1000;
-			q->callback(&current.data);
+			q->callback(current.data, current.buffer);
 			lastFrameTime = current.time;
 			processingTime = os_gettime_ns() / 1000 - lastStartTime;
-		} else {
-			qDebug() << "dropped" << current.time - lastFrameTime
-				 << processingTime;
-		} // else we drop the frame
-		free((void *)current.data.data);
+			first = false;
+		}
+		current.buffer->release();
+		q->drained++;
+		q->returnCredits(false);
 	}
 }
@@ -18,39 +18,71 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 
 #ifndef OBS_SSP_VFRAMEQUEUE_H
 #define OBS_SSP_VFRAMEQUEUE_H
-#include <QQueue>
-#include <QAtomicInt>
-#include <QSemaphore>
-#include <QMutex>
-#include <imf/ISspClient.h>
+#include <atomic>
+#include <functional>
+#include <util/threading.h>
+#include <ssp_connector_proto.h>
+#include "ssp-buffer-pool.h"
 #include "pthread.h"
 
+// must be a power of two
+#define VFRAME_QUEUE_SIZE 64
+// queued frames after which a late decoder gives up and skips to the next IDR
+#define VFRAME_BACKLOG_SKIP 16
+// consumed frames returned to the sender's credit window at once
+#define VFRAME_CREDIT_BATCH 8
+
+/* Bounded single producer (receive thread) / single consumer (decode thread)
+ * ring. The consumer only sleeps on an event when the ring is empty, and the
+ * producer only signals it when the consumer is actually sleeping. */
 class VFrameQueue {
 	struct Frame {
-		imf::SspH264Data data;
+		VideoData *data;
+		SSPBuffer *buffer;
 		uint64_t time;
-		bool noDrop;
+		uint32_t flags;
 	};
-	typedef std::function<void(imf::SspH264Data *)> CallbackFunc;
+	typedef std::function<void(VideoData *, SSPBuffer *)> CallbackFunc;
+	typedef std::function<void(uint32_t)> DrainFunc;
 
 public:
 	VFrameQueue();
-	void enqueue(imf::SspH264Data, uint64_t time_us, bool noDrop);
+	~VFrameQueue();
+	void enqueue(VideoData *data, SSPBuffer *buffer, uint64_t time_us);
 	void setFrameTime(uint64_t time_us);
+	void setVideoMeta(uint32_t gop);
 	void setFrameCallback(CallbackFunc);
+	void setDrainCallback(DrainFunc);
 	void start();
 	void stop();
 
 private:
 	static void run(VFrameQueue *q);
 	static void *pthread_run(void *q);
+	bool dequeue(Frame *frame);
+	bool skipToKeyframe(uint32_t sinceKeyframe);
+	void returnCredits(bool flush);
 	CallbackFunc callback;
-	QQueue<Frame> frameQueue;
-	QSemaphore sem;
-	QMutex queueLock;
+	DrainFunc drainCallback;
+	Frame ring[VFRAME_QUEUE_SIZE];
+	std::atomic<uint32_t> head;
+	std::atomic<uint32_t> tail;
+	std::atomic<bool> sleeping;
+	os_event_t *wakeup;
 	pthread_t thread;
-	QAtomicInt running;
+	std::atomic<bool> running;
 	uint64_t maxTime;
+	std::atomic<uint32_t> gop;
+
+	// producer side
+	bool overflowed;
+	uint64_t overflows;
+	// frames refused by enqueue, their credits go back with the next batch
+	std::atomic<uint32_t> refused;
+	// consumer side
+	uint32_t drained;
+	uint64_t droppedNonRef;
+	uint64_t droppedToKeyframe;
 };
 
 #endif //OBS_SSP_VFRAMEQUEUE_H
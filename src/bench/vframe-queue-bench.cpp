@@ -0,0 +1,213 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+/* Enqueue to dequeue latency and throughput of VFrameQueue, against the
+ * QQueue/QMutex/QSemaphore queue it replaced. A producer thread feeds
+ * synthetic keyframes, so nothing is dropped, and the frame callback on the
+ * decode thread takes the measurements.
+ *
+ *   vframe-queue-bench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <QQueue>
+#include <QSemaphore>
+#include <QMutex>
+#include <obs.h>
+#include <util/platform.h>
+#include <ssp_connector_proto.h>
+#include <ssp_connector_nal.h>
+
+#include "VFrameQueue.h"
+#include "ssp-buffer-pool.h"
+
+// frames in flight in the throughput run, below VFRAME_QUEUE_SIZE
+#define BENCH_WINDOW 32
+// producer interval of the latency run, a 1000 fps camera
+#define BENCH_INTERVAL_NS 1000000ULL
+
+// the queue before the SPSC ring, without its frame dropping
+class LegacyFrameQueue {
+	struct Frame {
+		VideoData *data;
+		SSPBuffer *buffer;
+	};
+	typedef std::function<void(VideoData *)> CallbackFunc;
+
+public:
+	void enqueue(VideoData *data, SSPBuffer *buffer)
+	{
+		QMutexLocker locker(&queueLock);
+		buffer->addRef();
+		frameQueue.enqueue({data, buffer});
+		sem.release();
+	}
+	void setFrameCallback(CallbackFunc cb) { callback = std::move(cb); }
+	void start()
+	{
+		running = true;
+		thread = std::thread(&LegacyFrameQueue::run, this);
+	}
+	void stop()
+	{
+		running = false;
+		sem.release();
+		thread.join();
+	}
+
+private:
+	void run()
+	{
+		while (running) {
+			sem.acquire();
+			queueLock.lock();
+			if (frameQueue.empty()) {
+				queueLock.unlock();
+				continue;
+			}
+			Frame current = frameQueue.dequeue();
+			queueLock.unlock();
+			callback(current.data);
+			current.buffer->release();
+		}
+	}
+
+	CallbackFunc callback;
+	QQueue<Frame> frameQueue;
+	QSemaphore sem;
+	QMutex queueLock;
+	std::thread thread;
+	std::atomic<bool> running;
+};
+
+struct BenchRun {
+	std::vector<uint64_t> latency;
+	std::atomic<uint32_t> consumed;
+};
+
+static void on_frame(BenchRun *run, VideoData *data)
+{
+	run->latency.push_back(os_gettime_ns() - data->pts);
+	run->consumed.fetch_add(1, std::memory_order_release);
+}
+
+typedef std::function<void(VideoData *, SSPBuffer *, uint64_t)> EnqueueFunc;
+
+/* Sends frames either paced at BENCH_INTERVAL_NS or as fast as the window
+ * allows, returns the producer's wall time. */
+static uint64_t produce(BenchRun *run, const EnqueueFunc &enqueue,
+			uint32_t frames, bool paced)
+{
+	auto pool = SSPBufferPool::global();
+	uint64_t start = os_gettime_ns();
+	for (uint32_t i = 0; i < frames; ++i) {
+		if (paced) {
+			os_sleepto_ns(start + i * BENCH_INTERVAL_NS);
+		} else {
+			while (i - run->consumed.load(
+					   std::memory_order_acquire) >=
+			       BENCH_WINDOW) {
+				std::this_thread::yield();
+			}
+		}
+		auto buffer =
+			pool->acquire(sizeof(Message) + sizeof(VideoData));
+		auto msg = (Message *)buffer->data;
+		auto video = (VideoData *)msg->value;
+		msg->type = VideoDataMsg;
+		msg->length = sizeof(VideoData);
+		memset(video, 0, sizeof(VideoData));
+		video->frm_no = i;
+		video->flags = SSP_NAL_FLAG_KEYFRAME;
+		video->pts = os_gettime_ns();
+		enqueue(video, buffer, (uint64_t)i * 16667);
+		buffer->release();
+	}
+	while (run->consumed.load(std::memory_order_acquire) < frames) {
+		std::this_thread::yield();
+	}
+	return os_gettime_ns() - start;
+}
+
+static void report(const char *name, const char *mode, BenchRun *run,
+		   uint64_t wall)
+{
+	auto &lat = run->latency;
+	std::sort(lat.begin(), lat.end());
+	size_t n = lat.size();
+	printf("%-12s %-10s %u frames: %.0f frames/s, latency median %.1f us, "
+	       "p99 %.1f us, max %.1f us\n",
+	       name, mode, (unsigned)n, n * 1e9 / wall, lat[n / 2] / 1000.0,
+	       lat[n * 99 / 100] / 1000.0, lat[n - 1] / 1000.0);
+}
+
+static void bench_ring(uint32_t frames, bool paced)
+{
+	BenchRun run;
+	run.latency.reserve(frames);
+	run.consumed = 0;
+	VFrameQueue queue;
+	queue.setFrameCallback(
+		[&run](VideoData *data, SSPBuffer *) { on_frame(&run, data); });
+	queue.start();
+	uint64_t wall = produce(
+		&run,
+		[&queue](VideoData *data, SSPBuffer *buffer, uint64_t time) {
+			queue.enqueue(data, buffer, time);
+		},
+		frames, paced);
+	queue.stop();
+	report("VFrameQueue", paced ? "paced" : "throughput", &run, wall);
+}
+
+static void bench_legacy(uint32_t frames, bool paced)
+{
+	BenchRun run;
+	run.latency.reserve(frames);
+	run.consumed = 0;
+	LegacyFrameQueue queue;
+	queue.setFrameCallback(
+		[&run](VideoData *data) { on_frame(&run, data); });
+	queue.start();
+	uint64_t wall = produce(
+		&run,
+		[&queue](VideoData *data, SSPBuffer *buffer, uint64_t) {
+			queue.enqueue(data, buffer);
+		},
+		frames, paced);
+	queue.stop();
+	report("QQueue", paced ? "paced" : "throughput", &run, wall);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t frames = argc > 1 ? (uint32_t)atoi(argv[1]) : 200000;
+	uint32_t paced = std::min<uint32_t>(frames, 5000);
+	bench_legacy(paced, true);
+	bench_ring(paced, true);
+	bench_legacy(frames, false);
+	bench_ring(frames, false);
+	return 0;
+}
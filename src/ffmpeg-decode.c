@@ -17,10 +17,7 @@
 
 #include "ffmpeg-decode.h"
 #include "obs-ffmpeg-compat.h"
-#include <obs-avc.h>
-#ifdef ENABLE_HEVC
-#include <obs-hevc.h>
-#endif
+#include <util/platform.h>
 
 enum AVHWDeviceType hw_priority[] = {
 	AV_HWDEVICE_TYPE_QSV,          AV_HWDEVICE_TYPE_CUDA,
@@ -67,7 +64,8 @@ static void init_hw_decoder(struct ffmpeg_decode *d)
 }
 
 int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id,
-		       bool use_hw)
+		       bool use_hw, enum ffmpeg_decode_profile profile,
+		       int threads)
 {
 	int ret;
 
@@ -78,9 +76,28 @@ int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id,
 		return -1;
 
 	decode->decoder = avcodec_alloc_context3(decode->codec);
+	decode->packet = av_packet_alloc();
+	if (!decode->decoder || !decode->packet) {
+		ffmpeg_decode_free(decode);
+		return -1;
+	}
 
-	decode->decoder->thread_count = 0;
+	decode->decoder->thread_count = threads;
 	decode->decoder->delay = 0;
+	decode->profile = profile;
+
+	switch (profile) {
+	case FFMPEG_DECODE_LOW_LATENCY:
+		decode->decoder->thread_type = FF_THREAD_SLICE;
+		decode->decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		decode->decoder->flags2 |= AV_CODEC_FLAG2_FAST;
+		break;
+	case FFMPEG_DECODE_THROUGHPUT:
+		decode->decoder->thread_type = FF_THREAD_FRAME;
+		break;
+	default:
+		break;
+	}
 
 	if (use_hw)
 		init_hw_decoder(decode);
@@ -102,6 +119,9 @@ void ffmpeg_decode_free(struct ffmpeg_decode *decode)
 	if (decode->decoder)
 		avcodec_free_context(&decode->decoder);
 
+	if (decode->packet)
+		av_packet_free(&decode->packet);
+
 	if (decode->frame)
 		av_frame_free(&decode->frame);
 
@@ -200,6 +220,55 @@ static inline enum speaker_layout convert_speaker_layout(uint8_t channels)
 	}
 }
 
+const char *ffmpeg_decode_profile_name(enum ffmpeg_decode_profile p)
+{
+	switch (p) {
+	case FFMPEG_DECODE_LOW_LATENCY:
+		return "low latency";
+	case FFMPEG_DECODE_THROUGHPUT:
+		return "throughput";
+	default:
+		return "default";
+	}
+}
+
+static void latency_begin(struct ffmpeg_decode *d, int64_t pts)
+{
+	d->latency_pts[d->latency_pos] = pts;
+	d->latency_start[d->latency_pos] = os_gettime_ns();
+	d->latency_pos = (d->latency_pos + 1) % FFMPEG_DECODE_LATENCY_SLOTS;
+}
+
+static void latency_end(struct ffmpeg_decode *d, int64_t pts)
+{
+	for (size_t i = 0; i < FFMPEG_DECODE_LATENCY_SLOTS; i++) {
+		if (d->latency_start[i] && d->latency_pts[i] == pts) {
+			uint64_t t = os_gettime_ns() - d->latency_start[i];
+			d->latency_start[i] = 0;
+			d->latency_total += t;
+			if (t > d->latency_max)
+				d->latency_max = t;
+			d->latency_count++;
+			return;
+		}
+	}
+}
+
+uint32_t ffmpeg_decode_take_latency(struct ffmpeg_decode *decode,
+				    double *avg_ms, double *max_ms)
+{
+	uint32_t count = decode->latency_count;
+
+	*avg_ms = count ? decode->latency_total / (double)count / 1000000.0
+			: 0.0;
+	*max_ms = decode->latency_max / 1000000.0;
+
+	decode->latency_total = 0;
+	decode->latency_max = 0;
+	decode->latency_count = 0;
+	return count;
+}
+
 static inline void copy_data(struct ffmpeg_decode *decode, uint8_t *data,
 			     size_t size)
 {
@@ -233,13 +302,13 @@ bool ffmpeg_decode_audio(struct ffmpeg_decode *decode, uint8_t *data,
 	}
 
 	if (data && size) {
-		AVPacket *packet = av_packet_alloc();
+		AVPacket *packet = decode->packet;
 		packet->data = decode->packet_buffer;
 		packet->size = (int)size;
 
 		ret = avcodec_send_packet(decode->decoder, packet);
 
-		av_packet_free(&packet);
+		av_packet_unref(packet);
 	}
 	if (ret == 0)
 		ret = avcodec_receive_frame(decode->decoder, decode->frame);
@@ -297,7 +366,8 @@ convert_color_space(enum AVColorSpace s, enum AVColorTransferCharacteristic trc,
 }
 
 bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
-			 size_t size, long long *ts, enum video_colorspace cs,
+			 size_t size, AVBufferRef *buf, bool keyframe,
+			 int64_t *ts, enum video_colorspace cs,
 			 enum video_range_type range,
 			 struct obs_source_frame2 *frame, bool *got_output)
 {
@@ -307,45 +377,41 @@ bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
 
 	*got_output = false;
 
-	copy_data(decode, data, size);
-
 	if (!decode->frame) {
 		decode->frame = av_frame_alloc();
-		if (!decode->frame)
-			return false;
-
-		if (decode->hw && !decode->hw_frame) {
+		if (decode->frame && decode->hw && !decode->hw_frame)
 			decode->hw_frame = av_frame_alloc();
-			if (!decode->hw_frame)
-				return false;
+
+		if (!decode->frame || (decode->hw && !decode->hw_frame)) {
+			av_buffer_unref(&buf);
+			return false;
 		}
 	}
 
 	out_frame = decode->hw ? decode->hw_frame : decode->frame;
 
-	AVPacket *packet = av_packet_alloc();
-	packet->data = decode->packet_buffer;
+	AVPacket *packet = decode->packet;
+	if (buf) {
+		packet->buf = buf;
+		packet->data = data;
+	} else {
+		copy_data(decode, data, size);
+		packet->data = decode->packet_buffer;
+	}
 	packet->size = (int)size;
 	packet->pts = *ts;
+	latency_begin(decode, *ts);
 
-	switch (decode->codec->id) {
-	case AV_CODEC_ID_H264:
-		if (obs_avc_keyframe(data, size))
-			packet->flags |= AV_PKT_FLAG_KEY;
-#ifdef ENABLE_HEVC
-		break;
-	case AV_CODEC_ID_HEVC:
-		if (obs_hevc_keyframe(data, size))
-			packet->flags |= AV_PKT_FLAG_KEY;
-#endif
-	}
+	if (keyframe)
+		packet->flags |= AV_PKT_FLAG_KEY;
 
 	ret = avcodec_send_packet(decode->decoder, packet);
 	if (ret == 0) {
 		ret = avcodec_receive_frame(decode->decoder, out_frame);
 	}
 
-	av_packet_free(&packet);
+	// drops our reference to buf, the decoder took its own if it needs one
+	av_packet_unref(packet);
 
 	got_frame = (ret == 0);
 
@@ -357,6 +423,8 @@ bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
 	else if (!got_frame)
 		return true;
 
+	latency_end(decode, out_frame->pts);
+
 	if (got_frame && decode->hw) {
 		ret = av_hwframe_transfer_data(decode->frame, out_frame, 0);
 		if (ret < 0) {
@@ -36,6 +36,17 @@ extern "C" {
 #pragma warning(pop)
 #endif
 
+enum ffmpeg_decode_profile {
+	// libavcodec picks the threading, as it always did
+	FFMPEG_DECODE_DEFAULT,
+	// slice threads, a frame is output as soon as it is decoded
+	FFMPEG_DECODE_LOW_LATENCY,
+	// frame threads, each thread adds a frame of delay
+	FFMPEG_DECODE_THROUGHPUT,
+};
+
+#define FFMPEG_DECODE_LATENCY_SLOTS 32
+
 struct ffmpeg_decode {
 	AVBufferRef *hw_device_ctx;
 	AVCodecContext *decoder;
@@ -45,20 +56,43 @@ struct ffmpeg_decode {
 	AVFrame *frame;
 	bool hw;
 
+	// reused for every packet for the life of the decoder
+	AVPacket *packet;
 	uint8_t *packet_buffer;
 	size_t packet_size;
+
+	enum ffmpeg_decode_profile profile;
+	// when recent packets were sent, by pts, to measure decode latency
+	int64_t latency_pts[FFMPEG_DECODE_LATENCY_SLOTS];
+	uint64_t latency_start[FFMPEG_DECODE_LATENCY_SLOTS];
+	size_t latency_pos;
+	uint64_t latency_total;
+	uint64_t latency_max;
+	uint32_t latency_count;
 };
 
+/* threads caps the decoder threads, 0 lets libavcodec use one per core */
 extern int ffmpeg_decode_init(struct ffmpeg_decode *decode, enum AVCodecID id,
-			      bool use_hw);
+			      bool use_hw, enum ffmpeg_decode_profile profile,
+			      int threads);
 extern void ffmpeg_decode_free(struct ffmpeg_decode *decode);
 
+extern const char *ffmpeg_decode_profile_name(enum ffmpeg_decode_profile p);
+/* Average and worst packet-to-frame time since the last call, in ms.
+ * Returns the number of frames measured. */
+extern uint32_t ffmpeg_decode_take_latency(struct ffmpeg_decode *decode,
+					   double *avg_ms, double *max_ms);
+
 extern bool ffmpeg_decode_audio(struct ffmpeg_decode *decode, uint8_t *data,
 				size_t size, struct obs_source_audio *audio,
 				bool *got_output);
 
+/* With buf, data must lie in it and be followed by
+ * AV_INPUT_BUFFER_PADDING_SIZE zeroed bytes. The reference is taken over and
+ * the packet goes to the decoder without being copied. */
 extern bool ffmpeg_decode_video(struct ffmpeg_decode *decode, uint8_t *data,
-				size_t size, long long *ts,
+				size_t size, AVBufferRef *buf, bool keyframe,
+				int64_t *ts,
 				enum video_colorspace cs,
 				enum video_range_type range,
 				struct obs_source_frame2 *frame,
@@ -69,6 +103,12 @@ static inline bool ffmpeg_decode_valid(struct ffmpeg_decode *decode)
 	return decode->decoder != NULL;
 }
 
+// drop buffered frames and references but keep the opened codec
+static inline void ffmpeg_decode_flush(struct ffmpeg_decode *decode)
+{
+	avcodec_flush_buffers(decode->decoder);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,7 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include <string>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "ssp-mdns.h"
 
 #ifdef _WIN32
@@ -33,6 +34,7 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include <util/platform.h>
 #include <util/threading.h>
 #include <chrono>
+#include <random>
 #include <thread>
 
 #include "obs-ssp.h"
@@ -41,7 +43,12 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 
 #include "ssp-controller.h"
 #include "ssp-client-iso.h"
+#include "ssp-client-direct.h"
+#include "ssp-decode-budget.h"
+#include "ssp-recorder.h"
+#include "ssp-replay.h"
 #include "VFrameQueue.h"
+#include <ssp_connector_nal.h>
 
 extern "C" {
 #include "ffmpeg-decode.h"
@@ -59,10 +66,20 @@ extern "C" {
 #define PROP_LATENCY "latency"
 #define PROP_VIDEO_RANGE "video_range"
 #define PROP_EXP_WAIT_I "exp_wait_i_frame"
+#define PROP_CLIENT_MODE "ssp_client_mode"
+#define PROP_DECODE_PROFILE "ssp_decode_profile"
+#define PROP_DECODE_THREADS "ssp_decode_threads"
+#define PROP_IDLE_DECODE "ssp_idle_decode"
+#define PROP_BANDWIDTH "ssp_bandwidth"
+#define PROP_ISO_RECORD "ssp_iso_record"
+#define PROP_ISO_PATH "ssp_iso_path"
+#define PROP_ISO_FORMAT "ssp_iso_format"
+#define PROP_REPLAY_SECONDS "ssp_replay_seconds"
 
 #define PROP_BW_HIGHEST 0
 #define PROP_BW_LOWEST 1
 #define PROP_BW_AUDIO_ONLY 2
+#define PROP_BW_AUTO 3
 
 #define PROP_SYNC_INTERNAL 0
 #define PROP_SYNC_SSP_TIMESTAMP 1
@@ -70,6 +87,33 @@ extern "C" {
 #define PROP_LATENCY_NORMAL 0
 #define PROP_LATENCY_LOW 1
 
+#define PROP_CLIENT_ISOLATED 0
+#define PROP_CLIENT_DIRECT 1
+#define PROP_CLIENT_SHARED 2
+
+#define PROP_DECODE_AUTO 0
+#define PROP_DECODE_LOW_LATENCY 1
+#define PROP_DECODE_THROUGHPUT 2
+
+#define PROP_IDLE_ALL 0
+#define PROP_IDLE_KEYFRAMES 1
+#define PROP_IDLE_NONE 2
+
+// frames between decode latency reports in the log
+#define SSP_LATENCY_LOG_FRAMES 1800
+
+// reconnect delays double from the base up to the cap, with jitter
+#define SSP_RECONNECT_BASE_MS 250
+#define SSP_RECONNECT_MAX_MS 10000
+
+enum ssp_conn_state {
+	SSP_CONN_IDLE,
+	SSP_CONN_SPAWNING,
+	SSP_CONN_CONNECTING,
+	SSP_CONN_STREAMING,
+	SSP_CONN_BACKOFF,
+};
+
 #define PROP_LED_TALLY "led_as_tally_light"
 #define PROP_RESOLUTION "ssp_resolution"
 #define PROP_FRAME_RATE "ssp_frame_rate"
@@ -87,7 +131,7 @@ using namespace std::placeholders;
 struct ssp_source;
 
 struct ssp_connection {
-	SSPClientIso *client;
+	SSPClient *client;
 	ffmpeg_decode vdecoder;
 	uint32_t width;
 	uint32_t height;
@@ -102,17 +146,76 @@ struct ssp_connection {
 	VFrameQueue *queue;
 	bool running;
 	int i_frame_shown;
-
-	// copy from ssp_source
+	uint32_t ps_hash;
+	// neither active nor showing, what still gets decoded is idle_decode
+	std::atomic<bool> idle;
+	std::atomic<int> idle_decode;
+	int bandwidth;
+	bool resync;
+	uint32_t idle_skipped;
+	// STREAM_SEC for the preview proxy of PROP_BW_AUTO
+	int stream_style;
+	// no output while set: a stream switched to, until its first frame is
+	// decoded, or the stream switched away from
+	std::atomic<bool> muted;
+	bool switching;
+	// switched away from, its output is no longer wanted
+	std::atomic<bool> retired;
+	ssp_source *parent;
+	// next in the parent's reap_list
+	ssp_connection *reap_next;
+	// ISO recording of the received stream, fed from the receive side
+	SSPRecorder *recorder;
+	// the instant replay of ssp_source, fed by whichever stream is shown
+	SSPReplayBuffer *replay;
+	/* Connecting and reconnecting is done by the worker alone. A
+	 * disconnect only sets reconnect, however often it comes, the
+	 * session tells the callbacks of a torn down client from ours. */
+	pthread_t worker;
+	bool worker_started;
+	pthread_mutex_t worker_lck;
+	pthread_cond_t worker_cond;
+	bool worker_stop;
+	bool reconnect;
+	std::atomic<int> state;
+	std::atomic<uint32_t> session;
+	uint32_t attempt;
+	// phases of the current attempt, to see where startup time goes
+	uint64_t start_time;
+	std::atomic<uint64_t> spawned_time;
+	std::atomic<uint64_t> connected_time;
+	std::atomic<uint64_t> meta_time;
+	std::atomic<uint64_t> idr_time;
+	bool first_frame;
+
+	// copy from ssp_source, the atomic ones follow it live
 	char *source_ip;
-	int hwaccel;
-	int bitrate;
-	int wait_i_frame;
-	int sync_mode;
+	std::atomic<int> hwaccel;
+	std::atomic<int> bitrate;
+	std::atomic<int> wait_i_frame;
+	std::atomic<int> sync_mode;
+	int client_mode;
+	// how the current client really talks to the camera, for the logs
+	const char *client_kind;
+	std::atomic<ffmpeg_decode_profile> decode_profile;
+	std::atomic<int> decode_threads;
+	SSPDecodeShare *share;
 	obs_source_t *source;
 	// not used
 	int video_range;
 
+	// what the decoders were opened for, they are kept across reconnects
+	AVCodecID dec_vformat;
+	uint32_t dec_width;
+	uint32_t dec_height;
+	AVCodecID dec_aformat;
+	int dec_threads;
+	int dec_thread_cap;
+	int dec_hwaccel;
+	ffmpeg_decode_profile dec_profile;
+	bool flush_video;
+	bool flush_audio;
+
 	pthread_mutex_t lck;
 };
 
@@ -126,60 +229,238 @@ struct ssp_source {
 	int bitrate;
 	int wait_i_frame;
 	int tally;
+	int client_mode;
+	ffmpeg_decode_profile decode_profile;
+	int decode_threads;
+	int idle_decode;
+	int bandwidth;
+	bool iso_record;
+	char *iso_path;
+	bool iso_matroska;
+	// what the camera was last configured with
+	int stream_index;
+	char *resolution;
+	bool low_noise;
+	char *framerate;
+	SSPReplayBuffer *replay;
+	obs_hotkey_id replay_hotkey;
+	bool active;
+	bool showing;
 
 	bool do_check;
 	bool no_check;
 	bool ip_checked;
 
 	const char *source_ip;
+	// guards conn and pending, a switch completes on a decode thread
+	pthread_mutex_t lck;
 	ssp_connection *conn;
+	// PROP_BW_AUTO: the other stream, muted until it has a frame
+	ssp_connection *pending;
+	/* Retired and cancelled connections, torn down by a reaper thread so
+	 * neither a decode thread nor the UI waits for a connection to stop.
+	 * The reaper runs while there is work, ssp_stop waits for it. */
+	pthread_mutex_t reap_lck;
+	pthread_cond_t reap_cond;
+	ssp_connection *reap_list;
+	pthread_t reaper;
+	bool reaper_started;
+	bool reaper_stop;
 };
 
 static void ssp_conn_start(ssp_connection *s);
 static void ssp_conn_stop(ssp_connection *s);
 static void ssp_stop(ssp_source *s);
 static void ssp_start(ssp_source *s);
-void *thread_ssp_reconnect(void *data);
+static void ssp_switch_done(ssp_connection *c);
+static void ssp_conn_first_output(ssp_connection *s);
 
-static void ssp_video_data_enqueue(struct imf::SspH264Data *video,
+static void ssp_video_data_enqueue(VideoData *video, SSPBuffer *buffer,
 				   ssp_connection *s)
 {
 	if (!s->running) {
 		return;
 	}
+	if (!s->idr_time.load(std::memory_order_relaxed) &&
+	    (video->flags & SSP_NAL_FLAG_KEYFRAME)) {
+		s->idr_time = os_gettime_ns();
+	}
+	if (!s->retired.load(std::memory_order_relaxed)) {
+		if (s->recorder) {
+			s->recorder->push(buffer);
+		}
+		if (!s->muted.load(std::memory_order_relaxed)) {
+			s->replay->push(buffer);
+		}
+	}
 	if (!s->queue) {
 		return;
 	}
-	s->queue->enqueue(*video, video->pts, video->type == 5);
+	s->queue->enqueue(video, buffer, video->pts);
+}
+
+/* A decoder that survived a reconnect is flushed and used again, unless the
+ * camera now sends a different stream, then it is rebuilt. */
+static void ssp_decoder_resume(ffmpeg_decode *decode, bool changed,
+			       bool *flush, const char *kind)
+{
+	if (ffmpeg_decode_valid(decode)) {
+		if (changed) {
+			ssp_blog(LOG_INFO,
+				 "%s stream changed, rebuilding decoder", kind);
+			ffmpeg_decode_free(decode);
+		} else if (*flush) {
+			ssp_blog(LOG_INFO, "reusing %s decoder", kind);
+			ffmpeg_decode_flush(decode);
+		}
+	}
+	*flush = false;
+}
+
+// our slice of the plugin-wide budget, within the source's own cap
+static int ssp_decode_threads(ssp_connection *s)
+{
+	int threads = s->share->threads.load(std::memory_order_relaxed);
+	int cap = s->decode_threads.load(std::memory_order_relaxed);
+	if (cap > 0) {
+		threads = std::min(threads, cap);
+	}
+	return threads;
+}
+
+/* A new share is worth a reopen only when it is far from what the decoder
+ * runs with, e.g. when the source went from preview to program or back. */
+static bool ssp_decode_threads_moved(ssp_connection *s)
+{
+	int threads = ssp_decode_threads(s);
+	return threads >= s->dec_threads * 2 || s->dec_threads >= threads * 2;
+}
+
+static void ssp_log_decode_latency(ssp_connection *s)
+{
+	if (s->vdecoder.latency_count < SSP_LATENCY_LOG_FRAMES) {
+		return;
+	}
+	double avg, max;
+	uint32_t frames = ffmpeg_decode_take_latency(&s->vdecoder, &avg, &max);
+	ssp_blog(LOG_INFO,
+		 "decode latency (%s, %s, %d threads): avg %.2f ms, "
+		 "max %.2f ms over %u frames",
+		 s->client_kind,
+		 ffmpeg_decode_profile_name(s->vdecoder.profile),
+		 s->vdecoder.decoder->thread_count, avg, max, frames);
 }
 
-static void ssp_on_video_data(struct imf::SspH264Data *video, ssp_connection *s)
+static_assert(SSP_BUFFER_PADDING >= AV_INPUT_BUFFER_PADDING_SIZE,
+	      "receive buffers must carry the decoder input padding");
+
+static void ssp_buffer_unref(void *opaque, uint8_t *data)
+{
+	UNUSED_PARAMETER(data);
+	((SSPBuffer *)opaque)->release();
+}
+
+static void ssp_on_video_data(VideoData *video, SSPBuffer *buffer,
+			      ssp_connection *s)
 {
 	if (!s->running) {
 		return;
 	}
+	bool keyframe = video->flags & SSP_NAL_FLAG_KEYFRAME;
+	if (s->idle.load(std::memory_order_relaxed)) {
+		// the session stays up, only keyframes refresh the thumbnail,
+		// and a stream being switched to still needs its first frame
+		s->resync = true;
+		if ((s->idle_decode == PROP_IDLE_NONE && !s->switching) ||
+		    !keyframe) {
+			s->idle_skipped++;
+			return;
+		}
+	} else if (s->resync) {
+		if (!keyframe) {
+			s->idle_skipped++;
+			return;
+		}
+		ssp_blog(LOG_INFO, "resumed decoding, %u frames skipped idle",
+			 s->idle_skipped);
+		s->resync = false;
+		s->idle_skipped = 0;
+	}
+	ssp_decoder_resume(&s->vdecoder,
+			   s->dec_vformat != s->vformat ||
+				   s->dec_width != s->width ||
+				   s->dec_height != s->height,
+			   &s->flush_video, "video");
+	// threads, hardware and profile are fixed once a decoder is open,
+	// new ones are taken up at the next keyframe with parameter sets
+	if (keyframe && (video->flags & SSP_NAL_FLAG_PARAMSET) &&
+	    ffmpeg_decode_valid(&s->vdecoder) &&
+	    (s->dec_thread_cap != s->decode_threads ||
+	     ssp_decode_threads_moved(s) ||
+	     s->dec_hwaccel != s->hwaccel ||
+	     s->dec_profile != s->decode_profile)) {
+		ssp_blog(LOG_INFO,
+			 "decoder settings changed (%d threads, %s, hw %d), "
+			 "reopening decoder",
+			 ssp_decode_threads(s),
+			 ffmpeg_decode_profile_name(s->decode_profile),
+			 (int)s->hwaccel);
+		ffmpeg_decode_free(&s->vdecoder);
+	}
+	if (video->flags & SSP_NAL_FLAG_PARAMSET) {
+		// new SPS/PPS/VPS, e.g. resolution or profile changed on camera
+		if (s->ps_hash && s->ps_hash != video->nal.ps_hash &&
+		    ffmpeg_decode_valid(&s->vdecoder)) {
+			ssp_blog(LOG_INFO,
+				 "parameter sets changed, resetting decoder");
+			ffmpeg_decode_free(&s->vdecoder);
+		}
+		s->ps_hash = video->nal.ps_hash;
+	}
 	if (!ffmpeg_decode_valid(&s->vdecoder)) {
 		assert(s->vformat == AV_CODEC_ID_H264 ||
 		       s->vformat == AV_CODEC_ID_HEVC);
-		if (ffmpeg_decode_init(&s->vdecoder, s->vformat, s->hwaccel) <
-		    0) {
+		int threads = ssp_decode_threads(s);
+		int hwaccel = s->hwaccel;
+		ffmpeg_decode_profile profile = s->decode_profile;
+		if (ffmpeg_decode_init(&s->vdecoder, s->vformat, hwaccel,
+				       profile, threads) < 0) {
 			ssp_blog(LOG_WARNING,
 				 "Could not initialize video decoder");
 			return;
 		}
+		s->dec_threads = threads;
+		s->dec_thread_cap = s->decode_threads;
+		s->dec_hwaccel = hwaccel;
+		s->dec_profile = profile;
+		s->dec_vformat = s->vformat;
+		s->dec_width = s->width;
+		s->dec_height = s->height;
 	}
 	if (s->wait_i_frame && !s->i_frame_shown) {
-		if (video->type == 5) {
+		if (keyframe) {
 			s->i_frame_shown = true;
 		} else {
 			return;
 		}
 	}
 
+	// the frame sits at the end of the receive buffer, followed by the
+	// pool's zeroed padding, so the decoder can reference it in place
+	buffer->addRef();
+	AVBufferRef *ref = av_buffer_create(
+		video->data, (int)video->len + SSP_BUFFER_PADDING,
+		ssp_buffer_unref, buffer, AV_BUFFER_FLAG_READONLY);
+	if (!ref) {
+		buffer->release();
+		return;
+	}
+
 	int64_t ts = video->pts;
 	bool got_output;
 	bool success = ffmpeg_decode_video(&s->vdecoder, video->data,
-					   video->len, &ts, VIDEO_CS_DEFAULT,
+					   video->len, ref, keyframe, &ts,
+					   VIDEO_CS_DEFAULT,
 					   VIDEO_RANGE_PARTIAL, &s->frame,
 					   &got_output);
 	if (!success) {
@@ -187,7 +468,10 @@ static void ssp_on_video_data(struct imf::SspH264Data *video, ssp_connection *s)
 		return;
 	}
 
-	if (got_output) {
+	if (got_output && s->switching) {
+		ssp_switch_done(s);
+	}
+	if (got_output && !s->muted.load(std::memory_order_relaxed)) {
 		if (s->sync_mode == PROP_SYNC_INTERNAL) {
 			s->frame.timestamp = os_gettime_ns();
 		} else {
@@ -196,21 +480,41 @@ static void ssp_on_video_data(struct imf::SspH264Data *video, ssp_connection *s)
 		//        if (flip)
 		//            frame.flip = !frame.flip;
 		obs_source_output_video2(s->source, &s->frame);
+		ssp_log_decode_latency(s);
+		if (!s->first_frame) {
+			ssp_conn_first_output(s);
+		}
 	}
 }
 
-static void ssp_on_audio_data(struct imf::SspAudioData *audio,
+static void ssp_on_audio_data(AudioData *audio, SSPBuffer *buffer,
 			      ssp_connection *s)
 {
 	if (!s->running) {
 		return;
 	}
+	if (s->recorder && !s->retired.load(std::memory_order_relaxed)) {
+		s->recorder->push(buffer);
+	}
+	if (s->muted.load(std::memory_order_relaxed)) {
+		return;
+	}
+	if (!s->retired.load(std::memory_order_relaxed)) {
+		s->replay->push(buffer);
+	}
+	if (s->bandwidth == PROP_BW_AUDIO_ONLY && !s->first_frame) {
+		ssp_conn_first_output(s);
+	}
+	ssp_decoder_resume(&s->adecoder, s->dec_aformat != s->aformat,
+			   &s->flush_audio, "audio");
 	if (!ffmpeg_decode_valid(&s->adecoder)) {
-		if (ffmpeg_decode_init(&s->adecoder, s->aformat, false) < 0) {
+		if (ffmpeg_decode_init(&s->adecoder, s->aformat, false,
+				       FFMPEG_DECODE_DEFAULT, 0) < 0) {
 			ssp_blog(LOG_WARNING,
 				 "Could not initialize audio decoder");
 			return;
 		}
+		s->dec_aformat = s->aformat;
 	}
 	uint8_t *data = audio->data;
 	size_t size = audio->len;
@@ -260,26 +564,106 @@ static void ssp_on_meta_data(struct imf::SspVideoMeta *v,
 		LOG_INFO,
 		"ssp i meta: pts_is_wall_clock: %u, tc_drop_frame:%u, timecode:%u,",
 		m->pts_is_wall_clock, m->tc_drop_frame, m->timecode);
+	if (!s->meta_time.load(std::memory_order_relaxed)) {
+		s->meta_time = os_gettime_ns();
+	}
 	s->vformat = v->encoder == VIDEO_ENCODER_H264 ? AV_CODEC_ID_H264
 						      : AV_CODEC_ID_H265;
+	s->width = v->width;
+	s->height = v->height;
 	s->frame.width = v->width;
 	s->frame.height = v->height;
 	s->sample_size = a->sample_size;
 	s->audio.samples_per_sec = a->sample_rate;
 	s->aformat = a->encoder == AUDIO_ENCODER_AAC ? AV_CODEC_ID_AAC
 						     : AV_CODEC_ID_NONE;
+	if (s->queue) {
+		s->queue->setVideoMeta(v->gop);
+	}
+	if (s->recorder) {
+		s->recorder->setVideoMeta(s->vformat, v->width, v->height);
+		s->recorder->setAudioMeta(s->aformat, a->sample_rate,
+					  a->channel);
+	}
+	if (!s->muted.load(std::memory_order_relaxed)) {
+		s->replay->setVideoMeta(s->vformat, v->width, v->height);
+		s->replay->setAudioMeta(s->aformat, a->sample_rate, a->channel);
+	}
+	// unit is the duration of a frame in timescale ticks
+	double fps = v->unit ? (double)v->timescale / v->unit : 0.0;
+	if (fps < 1.0 || fps > 240.0) {
+		fps = 30.0;
+	}
+	SSPDecodeBudget::global()->setWeight(s->share, v->width, v->height,
+					     fps);
+}
+
+static const char *ssp_conn_state_name(int state)
+{
+	switch (state) {
+	case SSP_CONN_SPAWNING:
+		return "spawning";
+	case SSP_CONN_CONNECTING:
+		return "connecting";
+	case SSP_CONN_STREAMING:
+		return "streaming";
+	case SSP_CONN_BACKOFF:
+		return "backoff";
+	default:
+		return "idle";
+	}
+}
+
+static void ssp_conn_set_state(ssp_connection *s, int state)
+{
+	int old = s->state.exchange(state);
+	if (old != state) {
+		ssp_blog(LOG_INFO, "ssp connection %s -> %s",
+			 ssp_conn_state_name(old), ssp_conn_state_name(state));
+	}
+}
+
+static double ssp_phase_ms(ssp_connection *s, uint64_t time)
+{
+	return time ? (time - s->start_time) / 1000000.0 : -1.0;
+}
+
+// the attempt made it, its phases go to the log
+static void ssp_conn_first_output(ssp_connection *s)
+{
+	s->first_frame = true;
+	ssp_conn_set_state(s, SSP_CONN_STREAMING);
+	ssp_blog(LOG_INFO,
+		 "startup (%s, attempt %u): spawn %.1f ms, connect %.1f ms, "
+		 "meta %.1f ms, first IDR %.1f ms, first frame %.1f ms",
+		 s->client_kind, s->attempt, ssp_phase_ms(s, s->spawned_time),
+		 ssp_phase_ms(s, s->connected_time),
+		 ssp_phase_ms(s, s->meta_time), ssp_phase_ms(s, s->idr_time),
+		 ssp_phase_ms(s, os_gettime_ns()));
 }
 
-static void ssp_on_disconnected(ssp_connection *s)
+static void ssp_on_connected(ssp_connection *s, uint32_t session)
 {
+	if (session != s->session.load()) {
+		return;
+	}
+	s->connected_time = os_gettime_ns();
+	ssp_blog(LOG_INFO, "ssp connected.");
+}
+
+static void ssp_on_disconnected(ssp_connection *s, uint32_t session)
+{
+	if (!s->running || session != s->session.load()) {
+		return;
+	}
 	ssp_blog(LOG_INFO, "ssp device disconnected.");
-	pthread_t thread;
-	if (s->running) {
-		ssp_blog(LOG_INFO, "still running, reconnect...");
-		pthread_create(&thread, nullptr, thread_ssp_reconnect,
-			       (void *)s);
-		pthread_detach(thread);
+	pthread_mutex_lock(&s->worker_lck);
+	if (s->reconnect) {
+		ssp_blog(LOG_DEBUG, "reconnect already pending");
 	}
+	s->reconnect = true;
+	pthread_cond_signal(&s->worker_cond);
+	pthread_mutex_unlock(&s->worker_lck);
 }
 
 static void ssp_on_exception(int code, const char *description,
@@ -289,40 +673,125 @@ static void ssp_on_exception(int code, const char *description,
 	//s->running = false;
 }
 
-static void ssp_start(ssp_source *s)
+// with s->lck held
+static void ssp_update_idle(ssp_source *s)
+{
+	bool idle = s->idle_decode != PROP_IDLE_ALL && !s->active &&
+		    !s->showing;
+	if (s->pending) {
+		s->pending->idle = idle;
+	}
+	if (s->conn && s->conn->idle.exchange(idle) != idle) {
+		ssp_blog(LOG_INFO, "ssp source %s", idle ? "idle" : "in use");
+	}
+}
+
+static int ssp_stream_style(ssp_source *s)
+{
+	switch (s->bandwidth) {
+	case PROP_BW_LOWEST:
+		return imf::STREAM_SEC;
+	case PROP_BW_AUTO:
+		// full quality only on program, the proxy is enough for preview
+		return s->active ? imf::STREAM_DEFAULT : imf::STREAM_SEC;
+	default:
+		return imf::STREAM_DEFAULT;
+	}
+}
+
+// the settings a running connection takes up as they change
+static void ssp_conn_apply(ssp_connection *conn, ssp_source *s)
+{
+	conn->wait_i_frame = s->wait_i_frame;
+	conn->hwaccel = s->hwaccel;
+	conn->sync_mode = s->sync_mode;
+	conn->decode_profile = s->decode_profile;
+	conn->decode_threads = s->decode_threads;
+	conn->idle_decode = s->idle_decode;
+	// the receive buffer of the next reconnect is sized from it
+	conn->bitrate = s->bitrate;
+}
+
+static ssp_connection *ssp_conn_create(ssp_source *s, int stream_style)
 {
 	auto conn = (ssp_connection *)bzalloc(sizeof(ssp_connection));
+	conn->parent = s;
+	conn->stream_style = stream_style;
 	conn->source = s->source;
 	conn->source_ip = strdup(s->source_ip);
-	conn->wait_i_frame = s->wait_i_frame;
-	conn->hwaccel = s->hwaccel;
 	conn->bitrate = s->bitrate;
-	conn->sync_mode = s->sync_mode;
 	conn->video_range = s->video_range;
+	conn->client_mode = s->client_mode;
+	conn->client_kind = "none";
+	ssp_conn_apply(conn, s);
+	conn->bandwidth = s->bandwidth;
+	conn->state = SSP_CONN_IDLE;
+	conn->share = SSPDecodeBudget::global()->join(s->active);
+	conn->replay = s->replay;
+	if (s->iso_record && s->iso_path && *s->iso_path) {
+		std::string prefix = std::string(s->iso_path) + "/" +
+				     obs_source_get_name(s->source);
+		if (stream_style == imf::STREAM_SEC) {
+			prefix += " preview";
+		}
+		conn->recorder =
+			new SSPRecorder(prefix, s->iso_matroska,
+					s->bandwidth != PROP_BW_AUDIO_ONLY);
+	}
 	pthread_mutex_init(&conn->lck, nullptr);
+	pthread_mutex_init(&conn->worker_lck, nullptr);
+	pthread_cond_init(&conn->worker_cond, nullptr);
+	return conn;
+}
 
+static void ssp_start(ssp_source *s)
+{
+	auto conn = ssp_conn_create(s, ssp_stream_style(s));
+	pthread_mutex_lock(&s->lck);
 	s->conn = conn;
+	ssp_update_idle(s);
+	pthread_mutex_unlock(&s->lck);
 	ssp_conn_start(conn);
 }
 
-static void ssp_conn_stop(ssp_connection *conn)
+static void ssp_conn_teardown(ssp_connection *conn)
 {
-	ssp_blog(LOG_INFO, "Stopping ssp client...");
-	pthread_mutex_lock(&conn->lck);
-	conn->running = false;
 	auto client = conn->client;
 	auto queue = conn->queue;
 
+	// whatever the old client still reports is not about us any more
+	conn->session++;
+
+	// the queue returns credits to the client until it is stopped
 	if (client) {
 		client->Stop();
-		delete client;
 	}
 	if (queue) {
 		queue->stop();
 		delete queue;
 	}
+	delete client;
+	conn->client = nullptr;
+	conn->queue = nullptr;
 
 	ssp_blog(LOG_INFO, "SSP client stopped.");
+}
+
+static void ssp_conn_stop(ssp_connection *conn)
+{
+	ssp_blog(LOG_INFO, "Stopping ssp client...");
+	conn->running = false;
+	if (conn->worker_started) {
+		pthread_mutex_lock(&conn->worker_lck);
+		conn->worker_stop = true;
+		pthread_cond_signal(&conn->worker_cond);
+		pthread_mutex_unlock(&conn->worker_lck);
+		pthread_join(conn->worker, nullptr);
+		conn->worker_started = false;
+	}
+	pthread_mutex_lock(&conn->lck);
+	ssp_conn_teardown(conn);
+	ssp_conn_set_state(conn, SSP_CONN_IDLE);
 
 	if (ffmpeg_decode_valid(&conn->adecoder)) {
 		ffmpeg_decode_free(&conn->adecoder);
@@ -330,131 +799,341 @@ static void ssp_conn_stop(ssp_connection *conn)
 	if (ffmpeg_decode_valid(&conn->vdecoder)) {
 		ffmpeg_decode_free(&conn->vdecoder);
 	}
-
-	ssp_blog(LOG_INFO, "SSP conn stopped.");
 	pthread_mutex_unlock(&conn->lck);
+	ssp_blog(LOG_INFO, "SSP conn stopped.");
 }
 
-static void ssp_stop(ssp_source *s)
+static void ssp_conn_destroy(ssp_connection *conn)
 {
-	if (!s) {
-		return;
-	}
-	auto conn = s->conn;
-	s->conn = nullptr;
-	if (!conn) {
-		return;
-	}
 	ssp_conn_stop(conn);
+	// nothing pushes any more, the recorder drains and closes its file
+	delete conn->recorder;
+	SSPDecodeBudget::global()->leave(conn->share);
 	free((void *)conn->source_ip);
+	pthread_cond_destroy(&conn->worker_cond);
+	pthread_mutex_destroy(&conn->worker_lck);
+	pthread_mutex_destroy(&conn->lck);
 	bfree(conn);
 }
 
-static void ssp_conn_start(ssp_connection *s)
+static void *thread_ssp_reaper(void *data)
 {
-	ssp_blog(LOG_INFO, "Starting ssp client...");
-	assert(s->client == nullptr);
-	assert(s->source != nullptr);
+	auto s = (ssp_source *)data;
+	os_set_thread_name("ssp-reaper");
+	pthread_mutex_lock(&s->reap_lck);
+	for (;;) {
+		while (!s->reap_list && !s->reaper_stop) {
+			pthread_cond_wait(&s->reap_cond, &s->reap_lck);
+		}
+		auto list = s->reap_list;
+		if (!list) {
+			break;
+		}
+		s->reap_list = nullptr;
+		pthread_mutex_unlock(&s->reap_lck);
+		while (list) {
+			auto next = list->reap_next;
+			ssp_conn_destroy(list);
+			list = next;
+		}
+		pthread_mutex_lock(&s->reap_lck);
+	}
+	pthread_mutex_unlock(&s->reap_lck);
+	return nullptr;
+}
 
-	std::string ip = s->source_ip;
-	ssp_blog(LOG_INFO, "target ip: %s", s->source_ip);
-	ssp_blog(LOG_INFO, "source bitrate: %d", s->bitrate);
-	if (strlen(s->source_ip) == 0) {
-		return;
+// hand a connection nobody uses any more to the reaper
+static void ssp_reap(ssp_source *s, ssp_connection *conn)
+{
+	pthread_mutex_lock(&s->reap_lck);
+	if (!s->reaper_started) {
+		s->reaper_stop = false;
+		s->reaper_started = pthread_create(&s->reaper, nullptr,
+						   thread_ssp_reaper, s) == 0;
 	}
+	if (s->reaper_started) {
+		conn->reap_next = s->reap_list;
+		s->reap_list = conn;
+		pthread_cond_signal(&s->reap_cond);
+		conn = nullptr;
+	}
+	pthread_mutex_unlock(&s->reap_lck);
+
+	if (conn) {
+		ssp_conn_destroy(conn);
+	}
+}
+
+// returns once every connection handed to the reaper is destroyed
+static void ssp_reap_wait(ssp_source *s)
+{
+	pthread_mutex_lock(&s->reap_lck);
+	bool started = s->reaper_started;
+	s->reaper_stop = true;
+	pthread_cond_signal(&s->reap_cond);
+	pthread_mutex_unlock(&s->reap_lck);
+	if (started) {
+		pthread_join(s->reaper, nullptr);
+	}
+	pthread_mutex_lock(&s->reap_lck);
+	s->reaper_started = false;
+	pthread_mutex_unlock(&s->reap_lck);
+}
+
+/* Called on the decode thread of a pending stream with its first decoded
+ * frame. It takes over the output right away, the stream it replaces is
+ * muted here and stopped by the reaper. */
+static void ssp_switch_done(ssp_connection *c)
+{
+	auto s = c->parent;
+	c->switching = false;
+
 	pthread_mutex_lock(&s->lck);
-	s->client = new SSPClientIso(ip, s->bitrate / 8);
-	s->client->setOnH264DataCallback(
-		std::bind(ssp_video_data_enqueue, _1, s));
-	s->client->setOnAudioDataCallback(std::bind(ssp_on_audio_data, _1, s));
-	s->client->setOnMetaCallback(
-		std::bind(ssp_on_meta_data, _1, _2, _3, s));
-	s->client->setOnConnectionConnectedCallback(
-		[]() { ssp_blog(LOG_INFO, "ssp connected."); });
-	s->client->setOnDisconnectedCallback(std::bind(ssp_on_disconnected, s));
-	s->client->setOnExceptionCallback(
-		std::bind(ssp_on_exception, _1, _2, s));
+	if (s->pending != c) {
+		// cancelled meanwhile, whoever did it stops us
+		pthread_mutex_unlock(&s->lck);
+		return;
+	}
+	auto old = s->conn;
+	s->conn = c;
+	s->pending = nullptr;
+	c->muted = false;
+	if (old) {
+		old->muted = true;
+		old->retired = true;
+	}
+	pthread_mutex_unlock(&s->lck);
 
-	assert(s->queue == nullptr);
-	s->queue = new VFrameQueue;
-	s->queue->setFrameCallback(std::bind(ssp_on_video_data, _1, s));
+	ssp_blog(LOG_INFO, "switched to the %s stream",
+		 c->stream_style == imf::STREAM_SEC ? "preview" : "main");
+	if (old) {
+		ssp_reap(s, old);
+	}
+}
 
-	s->queue->start();
-	emit s->client->Start();
-	s->running = true;
+/* PROP_BW_AUTO: start the stream the source should now show next to the one
+ * it is showing, the old one keeps the picture until the switch is done. */
+static void ssp_switch_stream(ssp_source *s)
+{
+	if (s->bandwidth != PROP_BW_AUTO) {
+		return;
+	}
+	int style = ssp_stream_style(s);
+
+	pthread_mutex_lock(&s->lck);
+	auto cancel = s->pending;
+	s->pending = nullptr;
+	if (s->conn && s->conn->stream_style != style) {
+		auto conn = ssp_conn_create(s, style);
+		conn->muted = true;
+		conn->switching = true;
+		s->pending = conn;
+		ssp_update_idle(s);
+		ssp_conn_start(conn);
+	}
 	pthread_mutex_unlock(&s->lck);
-	ssp_blog(LOG_INFO, "SSP client started.");
+
+	if (cancel) {
+		ssp_reap(s, cancel);
+	}
 }
 
-void *thread_ssp_reconnect(void *data)
+static void ssp_stop(ssp_source *s)
 {
-	auto conn = (ssp_connection *)data;
-	ssp_blog(LOG_INFO, "Stopping ssp client...");
-	pthread_mutex_lock(&conn->lck);
-	if (!conn->running) {
-		pthread_mutex_unlock(&conn->lck);
-		return nullptr;
+	if (!s) {
+		return;
 	}
-	auto client = conn->client;
-	auto queue = conn->queue;
+	pthread_mutex_lock(&s->lck);
+	auto conn = s->conn;
+	auto pending = s->pending;
+	s->conn = nullptr;
+	s->pending = nullptr;
+	pthread_mutex_unlock(&s->lck);
 
-	if (client) {
-		client->Stop();
-		delete client;
+	// stopped first, its decode thread could still complete a switch
+	if (pending) {
+		ssp_conn_destroy(pending);
 	}
-	if (queue) {
-		queue->stop();
-		delete queue;
+	// and with conn's decode thread gone nothing is handed to the reaper
+	if (conn) {
+		ssp_conn_destroy(conn);
 	}
+	ssp_reap_wait(s);
+}
 
-	ssp_blog(LOG_INFO, "SSP client stopped.");
+static SSPClient *ssp_create_client(ssp_connection *s, const std::string &ip)
+{
+	SSPClient *client;
+	if (s->client_mode == PROP_CLIENT_DIRECT &&
+	    SSPClientDirect::Available()) {
+		client = new SSPClientDirect(ip, s->bitrate / 8);
+		s->client_kind = "in-process";
+	} else {
+		if (s->client_mode == PROP_CLIENT_DIRECT) {
+			ssp_blog(LOG_WARNING,
+				 "libssp not available, falling back to "
+				 "ssp-connector");
+		}
+		client = new SSPClientIso(ip, s->bitrate / 8,
+					  s->client_mode == PROP_CLIENT_SHARED);
+		s->client_kind = s->client_mode == PROP_CLIENT_SHARED
+					 ? "shared connector"
+					 : "isolated connector";
+	}
+	client->setStreamStyle(s->stream_style);
+	client->setAudioOnly(s->bandwidth == PROP_BW_AUDIO_ONLY);
+	client->setOnVideoBufferCallback(
+		std::bind(ssp_video_data_enqueue, _1, _2, s));
+	client->setOnAudioBufferCallback(
+		std::bind(ssp_on_audio_data, _1, _2, s));
+	client->setOnMetaCallback(std::bind(ssp_on_meta_data, _1, _2, _3, s));
+	uint32_t session = s->session;
+	client->setOnConnectionConnectedCallback(
+		std::bind(ssp_on_connected, s, session));
+	client->setOnDisconnectedCallback(
+		std::bind(ssp_on_disconnected, s, session));
+	client->setOnExceptionCallback(std::bind(ssp_on_exception, _1, _2, s));
+	return client;
+}
 
-	if (ffmpeg_decode_valid(&conn->adecoder)) {
-		ffmpeg_decode_free(&conn->adecoder);
+static void ssp_conn_setup(ssp_connection *s, const std::string &ip)
+{
+	s->client = ssp_create_client(s, ip);
+
+	assert(s->queue == nullptr);
+	if (s->bandwidth == PROP_BW_AUDIO_ONLY) {
+		// no queue and so never a video decoder, clear the last frame
+		obs_source_output_video(s->source, nullptr);
+		s->client->Start();
+		return;
 	}
-	if (ffmpeg_decode_valid(&conn->vdecoder)) {
-		ffmpeg_decode_free(&conn->vdecoder);
+	s->queue = new VFrameQueue;
+	s->queue->setFrameCallback(std::bind(ssp_on_video_data, _1, _2, s));
+	// the sender may only run as far ahead as the queue can hold
+	s->client->setCreditWindow(VFRAME_QUEUE_SIZE);
+	s->queue->setDrainCallback(
+		std::bind(&SSPClient::GrantCredits, s->client, _1));
+
+	s->queue->start();
+	s->client->Start();
+}
+
+// jittered, so cameras that dropped together do not come back together
+static uint32_t ssp_backoff_ms(uint32_t attempt, std::minstd_rand &rng)
+{
+	uint32_t delay = SSP_RECONNECT_MAX_MS;
+	if (attempt < 16) {
+		delay = std::min<uint32_t>(SSP_RECONNECT_BASE_MS << attempt,
+					   SSP_RECONNECT_MAX_MS);
 	}
+	return delay / 2 + rng() % (delay / 2 + 1);
+}
 
-	ssp_blog(LOG_INFO, "SSP conn stopped.");
+// with worker_lck held, false when stopped meanwhile
+static bool ssp_worker_sleep(ssp_connection *s, uint32_t ms)
+{
+	// pthread_cond_timedwait wants the wall clock
+	auto until = std::chrono::system_clock::now() +
+		     std::chrono::milliseconds(ms);
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			     until.time_since_epoch())
+			     .count();
+	struct timespec deadline;
+	deadline.tv_sec = (time_t)(ns / 1000000000);
+	deadline.tv_nsec = (long)(ns % 1000000000);
+	while (!s->worker_stop) {
+		if (pthread_cond_timedwait(&s->worker_cond, &s->worker_lck,
+					   &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	return !s->worker_stop;
+}
+
+// one attempt: the old session goes, a new client is started
+static void ssp_conn_connect(ssp_connection *s)
+{
+	pthread_mutex_lock(&s->lck);
+	if (s->client) {
+		ssp_conn_teardown(s);
+		// the decoders stay open, the new session flushes or rebuilds
+		// them
+		s->flush_video = true;
+		s->flush_audio = true;
+	}
+	// disconnects up to here were about the session just torn down
+	pthread_mutex_lock(&s->worker_lck);
+	s->reconnect = false;
+	pthread_mutex_unlock(&s->worker_lck);
 
 	ssp_blog(LOG_INFO, "Starting ssp client...");
-	assert(conn->client == nullptr);
-	assert(conn->source != nullptr);
-
-	std::string ip = conn->source_ip;
-	ssp_blog(LOG_INFO, "target ip: %s", conn->source_ip);
-	ssp_blog(LOG_INFO, "source bitrate: %d", conn->bitrate);
-	if (strlen(conn->source_ip) == 0) {
-		pthread_mutex_unlock(&conn->lck);
-		return nullptr;
-	}
-	conn->client = new SSPClientIso(ip, conn->bitrate / 8);
-	conn->client->setOnH264DataCallback(
-		std::bind(ssp_video_data_enqueue, _1, conn));
-	conn->client->setOnAudioDataCallback(
-		std::bind(ssp_on_audio_data, _1, conn));
-	conn->client->setOnMetaCallback(
-		std::bind(ssp_on_meta_data, _1, _2, _3, conn));
-	conn->client->setOnConnectionConnectedCallback(
-		[]() { ssp_blog(LOG_INFO, "ssp connected."); });
-	conn->client->setOnDisconnectedCallback(
-		std::bind(ssp_on_disconnected, conn));
-	conn->client->setOnExceptionCallback(
-		std::bind(ssp_on_exception, _1, _2, conn));
-
-	assert(conn->queue == nullptr);
-	conn->queue = new VFrameQueue;
-	conn->queue->setFrameCallback(std::bind(ssp_on_video_data, _1, conn));
-
-	conn->queue->start();
-	emit conn->client->Start();
-	pthread_mutex_unlock(&conn->lck);
+	ssp_blog(LOG_INFO, "target ip: %s", s->source_ip);
+	ssp_blog(LOG_INFO, "source bitrate: %d", s->bitrate.load());
+	ssp_conn_set_state(s, SSP_CONN_SPAWNING);
+	s->start_time = os_gettime_ns();
+	s->spawned_time = 0;
+	s->connected_time = 0;
+	s->meta_time = 0;
+	s->idr_time = 0;
+	s->first_frame = false;
+	ssp_conn_setup(s, s->source_ip);
+	s->spawned_time = os_gettime_ns();
+	ssp_conn_set_state(s, SSP_CONN_CONNECTING);
+	pthread_mutex_unlock(&s->lck);
 	ssp_blog(LOG_INFO, "SSP client started.");
+}
 
+static void *thread_ssp_worker(void *data)
+{
+	auto s = (ssp_connection *)data;
+	std::minstd_rand rng((uint32_t)os_gettime_ns());
+	uint32_t failures = 0;
+
+	pthread_mutex_lock(&s->worker_lck);
+	while (!s->worker_stop) {
+		if (!s->reconnect) {
+			pthread_cond_wait(&s->worker_cond, &s->worker_lck);
+			continue;
+		}
+		// a stream that came up is reconnected at once the first time
+		if (s->state == SSP_CONN_STREAMING) {
+			failures = 0;
+		}
+		if (failures) {
+			uint32_t delay = ssp_backoff_ms(failures - 1, rng);
+			ssp_conn_set_state(s, SSP_CONN_BACKOFF);
+			ssp_blog(LOG_INFO, "reconnecting in %u ms", delay);
+			if (!ssp_worker_sleep(s, delay)) {
+				break;
+			}
+		}
+		s->attempt = ++failures;
+		pthread_mutex_unlock(&s->worker_lck);
+		ssp_conn_connect(s);
+		pthread_mutex_lock(&s->worker_lck);
+	}
+	pthread_mutex_unlock(&s->worker_lck);
 	return nullptr;
 }
 
+static void ssp_conn_start(ssp_connection *s)
+{
+	assert(s->client == nullptr);
+	assert(s->source != nullptr);
+	if (strlen(s->source_ip) == 0) {
+		return;
+	}
+	s->running = true;
+	s->reconnect = true;
+	s->worker_stop = false;
+	s->worker_started = pthread_create(&s->worker, nullptr,
+					   thread_ssp_worker, s) == 0;
+	if (!s->worker_started) {
+		ssp_blog(LOG_ERROR, "could not start the connection worker");
+		s->running = false;
+	}
+}
+
 static obs_source_frame *blank_video_frame()
 {
 	obs_source_frame *frame =
@@ -672,6 +1351,60 @@ obs_properties_t *ssp_source_getproperties(void *data)
 		props, PROP_EXP_WAIT_I,
 		obs_module_text("SSPPlugin.SourceProps.WaitIFrame"));
 
+	obs_property_t *client_modes = obs_properties_add_list(
+		props, PROP_CLIENT_MODE,
+		obs_module_text("SSPPlugin.SourceProps.ClientMode"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(
+		client_modes,
+		obs_module_text("SSPPlugin.ClientMode.Isolated"),
+		PROP_CLIENT_ISOLATED);
+	obs_property_list_add_int(
+		client_modes, obs_module_text("SSPPlugin.ClientMode.Direct"),
+		PROP_CLIENT_DIRECT);
+	obs_property_list_add_int(
+		client_modes, obs_module_text("SSPPlugin.ClientMode.Shared"),
+		PROP_CLIENT_SHARED);
+	if (!SSPClientDirect::Available()) {
+		obs_property_list_item_disable(client_modes, 1, true);
+	}
+
+	obs_property_t *decode_profiles = obs_properties_add_list(
+		props, PROP_DECODE_PROFILE,
+		obs_module_text("SSPPlugin.SourceProps.DecodeProfile"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(
+		decode_profiles,
+		obs_module_text("SSPPlugin.DecodeProfile.Auto"),
+		PROP_DECODE_AUTO);
+	obs_property_list_add_int(
+		decode_profiles,
+		obs_module_text("SSPPlugin.DecodeProfile.LowLatency"),
+		PROP_DECODE_LOW_LATENCY);
+	obs_property_list_add_int(
+		decode_profiles,
+		obs_module_text("SSPPlugin.DecodeProfile.Throughput"),
+		PROP_DECODE_THROUGHPUT);
+
+	obs_properties_add_int(
+		props, PROP_DECODE_THREADS,
+		obs_module_text("SSPPlugin.SourceProps.DecodeThreads"), 0, 64,
+		1);
+
+	obs_property_t *idle_modes = obs_properties_add_list(
+		props, PROP_IDLE_DECODE,
+		obs_module_text("SSPPlugin.SourceProps.IdleDecode"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(idle_modes,
+				  obs_module_text("SSPPlugin.IdleDecode.All"),
+				  PROP_IDLE_ALL);
+	obs_property_list_add_int(
+		idle_modes, obs_module_text("SSPPlugin.IdleDecode.Keyframes"),
+		PROP_IDLE_KEYFRAMES);
+	obs_property_list_add_int(idle_modes,
+				  obs_module_text("SSPPlugin.IdleDecode.None"),
+				  PROP_IDLE_NONE);
+
 	obs_property_t *resolutions = obs_properties_add_list(
 		props, PROP_RESOLUTION,
 		obs_module_text("SSPPlugin.SourceProps.Resolution"),
@@ -692,6 +1425,40 @@ obs_properties_t *ssp_source_getproperties(void *data)
 		obs_module_text("SSPPlugin.SourceProps.FrameRate"),
 		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
 
+	obs_property_t *bandwidths = obs_properties_add_list(
+		props, PROP_BANDWIDTH,
+		obs_module_text("SSPPlugin.SourceProps.Bandwidth"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(
+		bandwidths, obs_module_text("SSPPlugin.Bandwidth.Highest"),
+		PROP_BW_HIGHEST);
+	obs_property_list_add_int(bandwidths,
+				  obs_module_text("SSPPlugin.Bandwidth.Lowest"),
+				  PROP_BW_LOWEST);
+	obs_property_list_add_int(
+		bandwidths, obs_module_text("SSPPlugin.Bandwidth.AudioOnly"),
+		PROP_BW_AUDIO_ONLY);
+	obs_property_list_add_int(bandwidths,
+				  obs_module_text("SSPPlugin.Bandwidth.Auto"),
+				  PROP_BW_AUTO);
+
+	obs_properties_add_bool(
+		props, PROP_ISO_RECORD,
+		obs_module_text("SSPPlugin.SourceProps.IsoRecord"));
+	obs_properties_add_path(props, PROP_ISO_PATH,
+				obs_module_text("SSPPlugin.SourceProps.IsoPath"),
+				OBS_PATH_DIRECTORY, nullptr, nullptr);
+	obs_property_t *iso_formats = obs_properties_add_list(
+		props, PROP_ISO_FORMAT,
+		obs_module_text("SSPPlugin.SourceProps.IsoFormat"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(iso_formats, "Fragmented MP4", "mp4");
+	obs_property_list_add_string(iso_formats, "Matroska", "mkv");
+	obs_properties_add_int(
+		props, PROP_REPLAY_SECONDS,
+		obs_module_text("SSPPlugin.SourceProps.ReplaySeconds"), 0, 600,
+		5);
+
 	obs_properties_add_int(props, PROP_BITRATE,
 			       obs_module_text("SSPPlugin.SourceProps.Bitrate"),
 			       5, 300, 5);
@@ -720,46 +1487,114 @@ void ssp_source_getdefaults(obs_data_t *settings)
 	obs_data_set_default_int(settings, PROP_BITRATE, 20);
 	obs_data_set_default_bool(settings, PROP_HW_ACCEL, false);
 	obs_data_set_default_bool(settings, PROP_EXP_WAIT_I, true);
+	obs_data_set_default_int(settings, PROP_CLIENT_MODE,
+				 PROP_CLIENT_ISOLATED);
+	obs_data_set_default_int(settings, PROP_DECODE_PROFILE,
+				 PROP_DECODE_AUTO);
+	obs_data_set_default_int(settings, PROP_DECODE_THREADS, 0);
+	obs_data_set_default_int(settings, PROP_IDLE_DECODE,
+				 PROP_IDLE_KEYFRAMES);
+	obs_data_set_default_int(settings, PROP_BANDWIDTH, PROP_BW_HIGHEST);
+	obs_data_set_default_bool(settings, PROP_ISO_RECORD, false);
+	obs_data_set_default_string(settings, PROP_ISO_FORMAT, "mp4");
+	obs_data_set_default_int(settings, PROP_REPLAY_SECONDS, 0);
 	obs_data_set_default_bool(settings, PROP_LED_TALLY, false);
 	obs_data_set_default_bool(settings, PROP_LOW_NOISE, false);
 	obs_data_set_default_string(settings, PROP_ENCODER, "H264");
 	obs_data_set_default_string(settings, PROP_FRAME_RATE, "29.97");
 }
 
+/* Settings are compared with what is running. Local ones are applied live,
+ * the camera only gets the requests for what changed, and the stream is only
+ * restarted for a new camera, connection, codec, resolution or frame rate. */
 void ssp_source_update(void *data, obs_data_t *settings)
 {
 	auto s = (struct ssp_source *)data;
 
 	const char *source_ip;
-	ssp_stop(s);
-
-	s->hwaccel = obs_data_get_bool(settings, PROP_HW_ACCEL);
-
-	s->sync_mode = (int)obs_data_get_int(settings, PROP_SYNC);
 	source_ip = obs_data_get_string(settings, PROP_SOURCE_IP);
 	if (strcmp(source_ip, PROP_CUSTOM_VALUE) == 0) {
 		source_ip =
 			obs_data_get_string(settings, PROP_CUSTOM_SOURCE_IP);
 	}
 	if (strlen(source_ip) == 0) {
+		ssp_stop(s);
 		return;
 	}
 
-	if (s->source_ip) {
-		free((void *)s->source_ip);
+	pthread_mutex_lock(&s->lck);
+	bool running = s->conn != nullptr;
+	pthread_mutex_unlock(&s->lck);
+	// not streaming yet, or another camera: everything is sent again
+	bool fresh = !running || !s->source_ip ||
+		     strcmp(s->source_ip, source_ip) != 0;
+	if (fresh) {
+		if (s->source_ip) {
+			free((void *)s->source_ip);
+		}
+		s->source_ip = strdup(source_ip);
+
+		// Set the IP of our camera (used to build the url)
+		s->cameraStatus->setIp(s->source_ip);
 	}
-	s->source_ip = strdup(source_ip);
 
-	// Set the IP of our camera from the configuration (used to build the url)
-	s->cameraStatus->setIp(s->source_ip);
+	s->hwaccel = obs_data_get_bool(settings, PROP_HW_ACCEL);
+	s->sync_mode = (int)obs_data_get_int(settings, PROP_SYNC);
 
 	const bool is_unbuffered =
 		(obs_data_get_int(settings, PROP_LATENCY) == PROP_LATENCY_LOW);
 	obs_source_set_async_unbuffered(s->source, is_unbuffered);
 
+	switch (obs_data_get_int(settings, PROP_DECODE_PROFILE)) {
+	case PROP_DECODE_LOW_LATENCY:
+		s->decode_profile = FFMPEG_DECODE_LOW_LATENCY;
+		break;
+	case PROP_DECODE_THROUGHPUT:
+		s->decode_profile = FFMPEG_DECODE_THROUGHPUT;
+		break;
+	default:
+		// low latency trades decode throughput, only when asked for
+		s->decode_profile = FFMPEG_DECODE_DEFAULT;
+	}
+	s->decode_threads =
+		(int)obs_data_get_int(settings, PROP_DECODE_THREADS);
+	s->idle_decode = (int)obs_data_get_int(settings, PROP_IDLE_DECODE);
 	s->wait_i_frame = obs_data_get_bool(settings, PROP_EXP_WAIT_I);
+	s->replay->setDuration(
+		(uint32_t)obs_data_get_int(settings, PROP_REPLAY_SECONDS));
+
+	// the connection is built with these, a change needs a new one
+	bool restart = fresh;
+	int client_mode = (int)obs_data_get_int(settings, PROP_CLIENT_MODE);
+	int bandwidth = (int)obs_data_get_int(settings, PROP_BANDWIDTH);
+	bool iso_record = obs_data_get_bool(settings, PROP_ISO_RECORD);
+	const char *iso_path = obs_data_get_string(settings, PROP_ISO_PATH);
+	bool iso_matroska =
+		strcmp(obs_data_get_string(settings, PROP_ISO_FORMAT), "mkv") ==
+		0;
+	if (client_mode != s->client_mode || bandwidth != s->bandwidth ||
+	    iso_record != s->iso_record ||
+	    (iso_record && (!s->iso_path || strcmp(iso_path, s->iso_path) ||
+			    iso_matroska != s->iso_matroska))) {
+		restart = true;
+	}
+	s->client_mode = client_mode;
+	s->bandwidth = bandwidth;
+	s->replay->setAudioOnly(bandwidth == PROP_BW_AUDIO_ONLY);
+	s->iso_record = iso_record;
+	// a replay may be saved from another thread meanwhile
+	pthread_mutex_lock(&s->lck);
+	free(s->iso_path);
+	s->iso_path = strdup(iso_path);
+	s->iso_matroska = iso_matroska;
+	pthread_mutex_unlock(&s->lck);
+	if (s->iso_record && !*s->iso_path) {
+		ssp_blog(LOG_WARNING, "iso recording needs a directory");
+	}
 
-	s->tally = obs_data_get_bool(settings, PROP_LED_TALLY);
+	bool tally = obs_data_get_bool(settings, PROP_LED_TALLY);
+	bool tally_changed = tally != (bool)s->tally;
+	s->tally = tally;
 
 	auto encoder = obs_data_get_string(settings, PROP_ENCODER);
 	auto resolution = obs_data_get_string(settings, PROP_RESOLUTION);
@@ -777,12 +1612,87 @@ void ssp_source_update(void *data, obs_data_t *settings)
 
 	bitrate *= 1024 * 1024;
 
+	int changes = SSP_STREAM_SET_ALL;
+	if (!fresh) {
+		changes = 0;
+		if (stream_index != s->stream_index) {
+			changes |= SSP_STREAM_SET_ENCODER;
+		}
+		if (strcmp(resolution, s->resolution) != 0 ||
+		    low_noise != s->low_noise) {
+			changes |= SSP_STREAM_SET_RESOLUTION;
+		}
+		if (strcmp(framerate, s->framerate) != 0) {
+			changes |= SSP_STREAM_SET_FPS;
+		}
+		if (bitrate != s->bitrate) {
+			changes |= SSP_STREAM_SET_BITRATE;
+		}
+	}
+	// the camera changes its bitrate in stream, anything else is a new
+	// stream to decode
+	if (changes & ~SSP_STREAM_SET_BITRATE) {
+		restart = true;
+	}
+	s->stream_index = stream_index;
+	if (s->resolution) {
+		free(s->resolution);
+	}
+	s->resolution = strdup(resolution);
+	s->low_noise = low_noise;
+	if (s->framerate) {
+		free(s->framerate);
+	}
+	s->framerate = strdup(framerate);
 	s->bitrate = bitrate;
 
+	if (!restart) {
+		pthread_mutex_lock(&s->lck);
+		if (s->conn) {
+			ssp_conn_apply(s->conn, s);
+		}
+		if (s->pending) {
+			ssp_conn_apply(s->pending, s);
+		}
+		ssp_update_idle(s);
+		bool showing = s->showing;
+		pthread_mutex_unlock(&s->lck);
+		if (tally_changed) {
+			s->cameraStatus->setLed(tally && showing);
+		}
+		ssp_blog(LOG_INFO, "settings applied to the running stream");
+		if (changes) {
+			s->cameraStatus->setStream(
+				stream_index, resolution, low_noise, framerate,
+				bitrate, changes, [=](bool ok, QString reason) {
+					if (!ok) {
+						ssp_blog(LOG_WARNING,
+							 "setStream failed: %s",
+							 reason.toStdString()
+								 .c_str());
+					}
+				});
+		}
+		return;
+	}
+
+	ssp_stop(s);
+
+	// have a connector started while the camera is being configured
+	if (s->client_mode == PROP_CLIENT_ISOLATED) {
+		SSPConnector::Prewarm();
+	}
+
+	if (!changes) {
+		ssp_blog(LOG_INFO, "camera unchanged, restarting ssp");
+		ssp_start(s);
+		return;
+	}
+
 	ssp_blog(LOG_INFO, "Calling setStream on ssp source");
 	s->cameraStatus->setStream(
 		stream_index, resolution, low_noise, framerate, bitrate,
-		[=](bool ok, QString reason) {
+		changes, [=](bool ok, QString reason) {
 			if (!ok && !nocheck) {
 				blog(LOG_INFO, "%s",
 				     QString("setStream failed, not starting ssp: %1")
@@ -803,6 +1713,10 @@ void ssp_source_shown(void *data)
 	if (s->tally) {
 		s->cameraStatus->setLed(true);
 	}
+	pthread_mutex_lock(&s->lck);
+	s->showing = true;
+	ssp_update_idle(s);
+	pthread_mutex_unlock(&s->lck);
 	ssp_blog(LOG_INFO, "ssp source shown.");
 }
 
@@ -812,19 +1726,86 @@ void ssp_source_hidden(void *data)
 	if (s->tally) {
 		s->cameraStatus->setLed(false);
 	}
+	pthread_mutex_lock(&s->lck);
+	s->showing = false;
+	ssp_update_idle(s);
+	pthread_mutex_unlock(&s->lck);
 	ssp_blog(LOG_INFO, "ssp source hidden.");
 }
 
+static void ssp_set_active(ssp_source *s, bool active)
+{
+	auto budget = SSPDecodeBudget::global();
+	pthread_mutex_lock(&s->lck);
+	s->active = active;
+	if (s->conn) {
+		budget->setActive(s->conn->share, active);
+	}
+	if (s->pending) {
+		budget->setActive(s->pending->share, active);
+	}
+	ssp_update_idle(s);
+	pthread_mutex_unlock(&s->lck);
+
+	ssp_switch_stream(s);
+}
+
 void ssp_source_activated(void *data)
 {
+	auto s = (struct ssp_source *)data;
+	ssp_set_active(s, true);
 	ssp_blog(LOG_INFO, "ssp source activated.");
 }
 
 void ssp_source_deactivated(void *data)
 {
+	auto s = (struct ssp_source *)data;
+	ssp_set_active(s, false);
 	ssp_blog(LOG_INFO, "ssp source deactivated.");
 }
 
+// written next to the ISO recordings, in their format
+static void ssp_save_replay(ssp_source *s)
+{
+	pthread_mutex_lock(&s->lck);
+	std::string dir = s->iso_path ? s->iso_path : "";
+	bool matroska = s->iso_matroska;
+	pthread_mutex_unlock(&s->lck);
+
+	if (dir.empty()) {
+		ssp_blog(LOG_WARNING, "saving a replay needs a directory");
+		return;
+	}
+	std::string prefix =
+		dir + "/" + obs_source_get_name(s->source) + " replay";
+	if (!s->replay->save(prefix, matroska)) {
+		ssp_blog(LOG_WARNING, "no replay to save");
+	}
+}
+
+static void ssp_replay_hotkey(void *data, obs_hotkey_id id,
+			      obs_hotkey_t *hotkey, bool pressed)
+{
+	UNUSED_PARAMETER(id);
+	UNUSED_PARAMETER(hotkey);
+	if (pressed) {
+		ssp_save_replay((ssp_source *)data);
+	}
+}
+
+static void ssp_replay_proc(void *data, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	ssp_save_replay((ssp_source *)data);
+}
+
+// an open properties dialog lists the cameras found as they come and go
+static void ssp_devices_changed(void *data)
+{
+	auto s = (ssp_source *)data;
+	obs_source_update_properties(s->source);
+}
+
 void *ssp_source_create(obs_data_t *settings, obs_source_t *source)
 {
 	auto s = (struct ssp_source *)bzalloc(sizeof(struct ssp_source));
@@ -834,6 +1815,18 @@ void *ssp_source_create(obs_data_t *settings, obs_source_t *source)
 	s->ip_checked = false;
 	s->cameraStatus = new CameraStatus();
 	s->source_ip = nullptr;
+	pthread_mutex_init(&s->lck, nullptr);
+	pthread_mutex_init(&s->reap_lck, nullptr);
+	pthread_cond_init(&s->reap_cond, nullptr);
+	s->active = obs_source_active(source);
+	s->showing = obs_source_showing(source);
+	s->replay = new SSPReplayBuffer();
+	s->replay_hotkey = obs_hotkey_register_source(
+		source, "SSPPlugin.SaveReplay",
+		obs_module_text("SSPPlugin.SaveReplay"), ssp_replay_hotkey, s);
+	proc_handler_add(obs_source_get_proc_handler(source),
+			 "void save_replay()", ssp_replay_proc, s);
+	ssp_mdns_add_listener(ssp_devices_changed, s);
 	ssp_source_update(s, settings);
 	return s;
 }
@@ -842,6 +1835,7 @@ void ssp_source_destroy(void *data)
 {
 	auto s = (struct ssp_source *)data;
 	ssp_blog(LOG_INFO, "destroying source...");
+	ssp_mdns_remove_listener(ssp_devices_changed, s);
 	delete s->cameraStatus;
 	s->cameraStatus = nullptr;
 	if (s->source_ip) {
@@ -850,6 +1844,13 @@ void ssp_source_destroy(void *data)
 	}
 
 	ssp_stop(s);
+	delete s->replay;
+	free(s->iso_path);
+	free(s->resolution);
+	free(s->framerate);
+	pthread_cond_destroy(&s->reap_cond);
+	pthread_mutex_destroy(&s->reap_lck);
+	pthread_mutex_destroy(&s->lck);
 	bfree(s);
 	ssp_blog(LOG_INFO, "source destroyed.");
 }
@@ -26,8 +26,12 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include <util/platform.h>
 #include <util/dstr.h>
 #include <QDir>
+#include <QFileInfo>
 #include "obs-ssp.h"
 #include "ssp-controller.h"
+#include "ssp-connector.h"
+#include "ssp-decode-budget.h"
+#include "ssp-replay.h"
 
 #if defined(__APPLE__)
 
@@ -44,11 +48,68 @@ struct obs_source_info ssp_source_info;
 create_ssp_class_ptr create_ssp_class;
 create_loop_class_ptr create_loop_class;
 
+static void *libssp_handle;
+
+static void load_libssp()
+{
+#if defined(__APPLE__)
+	Dl_info info;
+	dladdr((const void *)load_libssp, &info);
+	QFileInfo plugin_path(info.dli_fname);
+	std::string path =
+		plugin_path.dir()
+			.filePath(QStringLiteral(LIBSSP_LIBRARY_NAME))
+			.toStdString();
+#else
+	std::string path = LIBSSP_LIBRARY_NAME;
+#endif
+	libssp_handle = os_dlopen(path.c_str());
+	if (!libssp_handle) {
+		ssp_blog(LOG_INFO,
+			 "libssp not loadable from %s, only isolated mode",
+			 path.c_str());
+		return;
+	}
+	create_ssp_class = (create_ssp_class_ptr)os_dlsym(libssp_handle,
+							  "create_ssp_class");
+	create_loop_class = (create_loop_class_ptr)os_dlsym(
+		libssp_handle, "create_loop_class");
+	if (!create_ssp_class || !create_loop_class) {
+		ssp_blog(LOG_WARNING, "libssp at %s misses entry points",
+			 path.c_str());
+		create_ssp_class = nullptr;
+		create_loop_class = nullptr;
+		os_dlclose(libssp_handle);
+		libssp_handle = nullptr;
+		return;
+	}
+	ssp_blog(LOG_INFO, "libssp loaded, in-process mode available");
+}
+
+/* Plugin-wide settings live in the module config directory, there is no
+ * UI for them. decode_thread_budget: decoder threads shared by all sources,
+ * 0 or missing for one per logical core. */
+static void load_config()
+{
+	char *path = obs_module_config_path("config.json");
+	obs_data_t *config = path ? obs_data_create_from_json_file(path)
+				  : nullptr;
+	bfree(path);
+	if (!config) {
+		return;
+	}
+	SSPDecodeBudget::global()->setBudget(
+		(int)obs_data_get_int(config, "decode_thread_budget"));
+	obs_data_release(config);
+}
+
 bool obs_module_load(void)
 {
 	ssp_blog(LOG_INFO, "hello ! (obs-ssp version %s) size: %lu",
 		 PLUGIN_VERSION, sizeof(ssp_source_info));
 
+	load_libssp();
+	load_config();
 	create_mdns_loop();
 	ssp_source_info = create_ssp_source_info();
 	obs_register_source(&ssp_source_info);
@@ -58,6 +119,14 @@ bool obs_module_load(void)
 void obs_module_unload()
 {
 	stop_mdns_loop();
+	SSPConnector::ShutdownAll();
+	SSPReplayBuffer::WaitForSaves();
+	if (libssp_handle) {
+		create_ssp_class = nullptr;
+		create_loop_class = nullptr;
+		os_dlclose(libssp_handle);
+		libssp_handle = nullptr;
+	}
 	ssp_blog(LOG_INFO, "goodbye !");
 }
 
@@ -0,0 +1,159 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <new>
+#include <string.h>
+#include <algorithm>
+#include <obs.h>
+
+#include "obs-ssp.h"
+#include "ssp-buffer-pool.h"
+
+#define SSP_POOL_HEADER_SIZE ((sizeof(SSPBuffer) + 63) & ~(size_t)63)
+#define SSP_POOL_MAX_CACHED 64
+
+static int size_class(size_t size)
+{
+	int shift = SSP_POOL_MIN_SHIFT;
+	while (shift <= SSP_POOL_MAX_SHIFT && ((size_t)1 << shift) < size) {
+		++shift;
+	}
+	return shift - SSP_POOL_MIN_SHIFT;
+}
+
+static size_t max_cached(int sizeClass)
+{
+	int shift = sizeClass + SSP_POOL_MIN_SHIFT;
+	return (size_t)std::min(SSP_POOL_MAX_CACHED,
+				std::max(2, 1 << (SSP_POOL_MAX_SHIFT - shift)));
+}
+
+void SSPBuffer::release()
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+		return;
+	}
+	if (dispose) {
+		dispose(this);
+	} else {
+		pool->recycle(this);
+	}
+}
+
+SSPBufferPool *SSPBufferPool::global()
+{
+	static SSPBufferPool pool;
+	return &pool;
+}
+
+SSPBufferPool::SSPBufferPool() : hitCount(0), missCount(0)
+{
+	for (int i = 0; i < SSP_POOL_CLASSES; ++i) {
+		freeLists[i].buffers.reserve(max_cached(i));
+	}
+}
+
+SSPBufferPool::~SSPBufferPool()
+{
+	for (auto &list : freeLists) {
+		for (auto buf : list.buffers) {
+			buf->~SSPBuffer();
+			bfree(buf);
+		}
+		list.buffers.clear();
+	}
+}
+
+SSPBuffer *SSPBufferPool::allocate(int sizeClass, size_t capacity)
+{
+	auto mem = (uint8_t *)bmalloc(SSP_POOL_HEADER_SIZE + capacity);
+	auto buf = new (mem) SSPBuffer;
+	buf->sizeClass = sizeClass;
+	buf->capacity = capacity;
+	buf->data = mem + SSP_POOL_HEADER_SIZE;
+	return buf;
+}
+
+SSPBuffer *SSPBufferPool::acquire(size_t size)
+{
+	SSPBuffer *buf = nullptr;
+	int sizeClass = size_class(size + SSP_BUFFER_PADDING);
+
+	if (sizeClass < SSP_POOL_CLASSES) {
+		auto &list = freeLists[sizeClass];
+		std::lock_guard<std::mutex> locker(list.lock);
+		if (!list.buffers.empty()) {
+			buf = list.buffers.back();
+			list.buffers.pop_back();
+		}
+	}
+
+	if (buf) {
+		hitCount.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		missCount.fetch_add(1, std::memory_order_relaxed);
+		size_t capacity = sizeClass < SSP_POOL_CLASSES
+					  ? (size_t)1 << (sizeClass +
+							  SSP_POOL_MIN_SHIFT)
+					  : size + SSP_BUFFER_PADDING;
+		buf = allocate(sizeClass, capacity);
+	}
+
+	buf->pool = this;
+	buf->refs.store(1, std::memory_order_relaxed);
+	buf->size = size;
+	buf->dispose = nullptr;
+	buf->opaque = nullptr;
+	memset(buf->data + size, 0, SSP_BUFFER_PADDING);
+	return buf;
+}
+
+/* A reference for holding on to buf for long. A wrapped buffer is copied so
+ * the memory it points into goes back to its owner in time. */
+SSPBuffer *SSPBufferPool::keep(SSPBuffer *buf)
+{
+	if (!buf->dispose) {
+		buf->addRef();
+		return buf;
+	}
+	auto copy = acquire(buf->size);
+	memcpy(copy->data, buf->data, buf->size);
+	return copy;
+}
+
+void SSPBufferPool::recycle(SSPBuffer *buf)
+{
+	if (buf->sizeClass < SSP_POOL_CLASSES) {
+		auto &list = freeLists[buf->sizeClass];
+		std::lock_guard<std::mutex> locker(list.lock);
+		if (list.buffers.size() < max_cached(buf->sizeClass)) {
+			list.buffers.push_back(buf);
+			return;
+		}
+	}
+	buf->~SSPBuffer();
+	bfree(buf);
+}
+
+void SSPBufferPool::logStats(const char *who) const
+{
+	uint64_t hit = hitCount, miss = missCount;
+	ssp_blog(LOG_INFO, "%s buffer pool: %llu hits, %llu misses (%.2f%%)",
+		 who, (unsigned long long)hit, (unsigned long long)miss,
+		 hit + miss ? hit * 100.0 / (hit + miss) : 0.0);
+}
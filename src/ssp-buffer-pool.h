@@ -0,0 +1,81 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_BUFFER_POOL_H
+#define OBS_SSP_SSP_BUFFER_POOL_H
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define SSP_POOL_MIN_SHIFT 12 // 4 KiB
+#define SSP_POOL_MAX_SHIFT 26 // 64 MiB
+#define SSP_POOL_CLASSES (SSP_POOL_MAX_SHIFT - SSP_POOL_MIN_SHIFT + 1)
+// zeroed bytes kept after every buffer, at least AV_INPUT_BUFFER_PADDING_SIZE
+// so a frame can go to the decoder without being copied
+#define SSP_BUFFER_PADDING 64
+
+class SSPBufferPool;
+
+/* A reference counted receive buffer. Messages are read straight into it and
+ * it is handed downstream by reference, the last release() gives it back to
+ * the pool it came from. A buffer may also wrap memory the pool does not own,
+ * then dispose is called in place of recycling it. */
+struct SSPBuffer {
+	SSPBufferPool *pool;
+	std::atomic<int> refs;
+	int sizeClass;
+	size_t capacity;
+	size_t size;
+	uint8_t *data;
+	void (*dispose)(SSPBuffer *buf);
+	void *opaque;
+
+	void addRef() { refs.fetch_add(1, std::memory_order_relaxed); }
+	void release();
+};
+
+class SSPBufferPool {
+public:
+	static SSPBufferPool *global();
+
+	SSPBufferPool();
+	~SSPBufferPool();
+
+	SSPBuffer *acquire(size_t size);
+	SSPBuffer *keep(SSPBuffer *buf);
+	void recycle(SSPBuffer *buf);
+
+	uint64_t hits() const { return hitCount; }
+	uint64_t misses() const { return missCount; }
+	void logStats(const char *who) const;
+
+private:
+	static SSPBuffer *allocate(int sizeClass, size_t capacity);
+
+	struct FreeList {
+		std::mutex lock;
+		std::vector<SSPBuffer *> buffers;
+	};
+	FreeList freeLists[SSP_POOL_CLASSES];
+	std::atomic<uint64_t> hitCount;
+	std::atomic<uint64_t> missCount;
+};
+
+#endif //OBS_SSP_SSP_BUFFER_POOL_H
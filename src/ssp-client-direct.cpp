@@ -0,0 +1,205 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <obs.h>
+#include <string.h>
+
+#include <ssp_connector_nal.h>
+
+#include "obs-ssp.h"
+#include "ssp-client-direct.h"
+
+using namespace std::placeholders;
+
+SSPClientDirect::SSPClientDirect(const std::string &ip, uint32_t bufferSize)
+{
+	this->ip = ip;
+	this->bufferSize = bufferSize;
+	this->running = false;
+	this->hevc = false;
+	this->setupDone = false;
+	this->loopDone = false;
+	this->loop = nullptr;
+	this->client = nullptr;
+}
+
+SSPClientDirect::~SSPClientDirect()
+{
+	Stop();
+}
+
+bool SSPClientDirect::Available()
+{
+	return create_ssp_class != nullptr && create_loop_class != nullptr;
+}
+
+/* imf::ThreadLoop can only quit its loop, but the client has to be stopped
+ * on the loop thread and the loop run again for the sockets it closes. */
+void SSPClientDirect::LoopThread()
+{
+	loop = create_loop_class();
+	loop->init();
+	Setup((imf::Loop *)loop->getLoop());
+	loop->loop();
+
+	// Stop() quit the loop, nothing else touches the client any more
+	if (client) {
+		client->stop();
+		loop->loop();
+	}
+	{
+		// Stop() may still quit the loop until this is set
+		std::lock_guard<std::mutex> locker(setupLock);
+		loopDone = true;
+		setupCond.notify_all();
+	}
+	if (client) {
+		client->destroy();
+		client = nullptr;
+	}
+	// the loop may also have run dry by itself, Stop() destroys it
+}
+
+void SSPClientDirect::Setup(imf::Loop *loop)
+{
+	auto c = create_ssp_class(ip, loop, bufferSize, 9999, streamStyle);
+	if (!c) {
+		ssp_blog(LOG_WARNING, "libssp failed to create client");
+		NotifySetup();
+		return;
+	}
+	c->init();
+	c->setOnH264DataCallback(
+		std::bind(&SSPClientDirect::OnH264Data, this, _1));
+	c->setOnAudioDataCallback(
+		std::bind(&SSPClientDirect::OnAudioData, this, _1));
+	c->setOnMetaCallback([this](imf::SspVideoMeta *v, imf::SspAudioMeta *a,
+				    imf::SspMeta *m) {
+		hevc = v->encoder == VIDEO_ENCODER_H265;
+		metaCallback(v, a, m);
+	});
+	c->setOnExceptionCallback(exceptionCallback);
+	c->setOnConnectionConnectedCallback(connectedCallback);
+	c->setOnRecvBufferFullCallback(bufferFullCallback);
+	c->setOnDisconnectedCallback(disconnectedCallback);
+	client = c;
+	c->start();
+	NotifySetup();
+}
+
+void SSPClientDirect::NotifySetup()
+{
+	std::lock_guard<std::mutex> locker(setupLock);
+	setupDone = true;
+	setupCond.notify_all();
+}
+
+void SSPClientDirect::Start()
+{
+	std::lock_guard<std::mutex> locker(statusLock);
+	if (running || !Available()) {
+		return;
+	}
+	ssp_blog(LOG_INFO, "Start in-process ssp client for %s", ip.c_str());
+	setupDone = false;
+	loopDone = false;
+	loopThread = std::thread(&SSPClientDirect::LoopThread, this);
+	running = true;
+
+	// Stop() needs the loop the thread creates, wait for it
+	std::unique_lock<std::mutex> setupLocker(setupLock);
+	setupCond.wait(setupLocker, [this]() { return setupDone; });
+}
+
+void SSPClientDirect::Stop()
+{
+	std::lock_guard<std::mutex> locker(statusLock);
+	if (!running) {
+		return;
+	}
+	ssp_blog(LOG_INFO, "ssp client stopping...");
+	running = false;
+	{
+		// the loop thread stops the client itself once its loop has
+		// quit, unless the loop already returned on its own
+		std::unique_lock<std::mutex> setupLocker(setupLock);
+		if (!loopDone) {
+			loop->quit();
+		}
+		if (!setupCond.wait_for(setupLocker,
+					std::chrono::milliseconds(
+						SSP_DIRECT_STOP_TIMEOUT_MS),
+					[this]() { return loopDone; })) {
+			// something stays open after the stop, quit regardless
+			ssp_blog(LOG_WARNING,
+				 "ssp client still closing, quit its loop");
+			loop->quit();
+		}
+	}
+	loopThread.join();
+	loop->destroy();
+	loop = nullptr;
+	SSPBufferPool::global()->logStats("ssp direct client");
+}
+
+void SSPClientDirect::Restart()
+{
+	Stop();
+	Start();
+}
+
+/* libssp owns its frame buffer, so the one copy we need anyway goes straight
+ * into a pooled buffer laid out exactly like a connector message. */
+void SSPClientDirect::OnH264Data(imf::SspH264Data *video)
+{
+	if (audioOnly) {
+		return;
+	}
+	size_t len = sizeof(Message) + sizeof(VideoData) + video->len;
+	auto buf = SSPBufferPool::global()->acquire(len);
+	auto msg = (Message *)buf->data;
+	msg->type = VideoDataMsg;
+	msg->length = sizeof(VideoData) + video->len;
+	auto videoData = (VideoData *)msg->value;
+	videoData->frm_no = video->frm_no;
+	videoData->ntp_timestamp = video->ntp_timestamp;
+	videoData->pts = video->pts;
+	videoData->type = video->type;
+	videoData->len = video->len;
+	memcpy(videoData->data, video->data, video->len);
+	videoData->flags = ssp_nal_scan(videoData->data, videoData->len, hevc,
+					&videoData->nal);
+	videoBufferCallback(videoData, buf);
+	buf->release();
+}
+
+void SSPClientDirect::OnAudioData(imf::SspAudioData *audio)
+{
+	size_t len = sizeof(Message) + sizeof(AudioData) + audio->len;
+	auto buf = SSPBufferPool::global()->acquire(len);
+	auto msg = (Message *)buf->data;
+	msg->type = AudioDataMsg;
+	msg->length = sizeof(AudioData) + audio->len;
+	auto audioData = (AudioData *)msg->value;
+	audioData->ntp_timestamp = audio->ntp_timestamp;
+	audioData->pts = audio->pts;
+	audioData->len = audio->len;
+	memcpy(audioData->data, audio->data, audio->len);
+	audioBufferCallback(audioData, buf);
+	buf->release();
+}
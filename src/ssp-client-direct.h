@@ -0,0 +1,69 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_CLIENT_DIRECT_H
+#define OBS_SSP_SSP_CLIENT_DIRECT_H
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <imf/ISspClient.h>
+#include "ssp-client.h"
+
+// how long a stopped client may take to close its connection
+#define SSP_DIRECT_STOP_TIMEOUT_MS 500
+
+/* Drives libssp in-process on a loop thread of its own, without the
+ * ssp-connector child process and pipe. Only usable when libssp could be
+ * loaded. */
+class SSPClientDirect : public SSPClient {
+public:
+	SSPClientDirect(const std::string &ip, uint32_t bufferSize);
+	~SSPClientDirect() override;
+
+	static bool Available();
+
+	void Start() override;
+	void Stop() override;
+	void Restart() override;
+
+private:
+	void LoopThread();
+	void Setup(imf::Loop *loop);
+	void NotifySetup();
+	void OnH264Data(imf::SspH264Data *video);
+	void OnAudioData(imf::SspAudioData *audio);
+
+	std::mutex statusLock;
+	bool running;
+	bool hevc;
+	std::mutex setupLock;
+	std::condition_variable setupCond;
+	bool setupDone;
+	bool loopDone;
+	std::string ip;
+	uint32_t bufferSize;
+
+	std::thread loopThread;
+	imf::ILoop_class *loop;
+	imf::ISspClient_class *client;
+};
+
+#endif //OBS_SSP_SSP_CLIENT_DIRECT_H
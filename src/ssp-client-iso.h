@@ -19,73 +19,39 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #ifndef OBS_SSP_SSP_CLIENT_ISO_H
 #define OBS_SSP_SSP_CLIENT_ISO_H
 #include <QObject>
-#include <QProcess>
 #include <mutex>
-#include <thread>
 
-#include <imf/ISspClient.h>
-extern "C" {
-#include <util/pipe.h>
-}
-#include <ssp_connector_proto.h>
+#include "ssp-client.h"
+#include "ssp-connector.h"
 
-#ifdef _WIN64
-#define SSP_CONNECTOR "../../obs-plugins/" OBS_SSP_BITSTR "/ssp-connector.exe"
-#else
-#define SSP_CONNECTOR "ssp-connector"
-#endif
-
-class SSPClientIso : public QObject {
+/* Receives a camera through an ssp-connector process, either one of its
+ * own or a stream on a connector shared with other sources. */
+class SSPClientIso : public QObject, public SSPClient {
 	Q_OBJECT
 
 public:
-	SSPClientIso(const std::string &ip, uint32_t bufferSize);
+	SSPClientIso(const std::string &ip, uint32_t bufferSize,
+		     bool shared = false);
 
-	virtual void
-	setOnRecvBufferFullCallback(const imf::OnRecvBufferFullCallback &cb);
-	virtual void setOnH264DataCallback(const imf::OnH264DataCallback &cb);
-	virtual void setOnAudioDataCallback(const imf::OnAudioDataCallback &cb);
-	virtual void setOnMetaCallback(const imf::OnMetaCallback &cb);
-	virtual void
-	setOnDisconnectedCallback(const imf::OnDisconnectedCallback &cb);
-	virtual void setOnConnectionConnectedCallback(
-		const imf::OnConnectionConnectedCallback &cb);
-	virtual void setOnExceptionCallback(const imf::OnExceptionCallback &cb);
-	void Stop();
-	void Restart();
-	static void *ReceiveThread(void *arg);
+	void Start() override;
+	void Stop() override;
+	void Restart() override;
+	void GrantCredits(uint32_t frames) override;
 signals:
-	void Start();
+	void StartRequested();
 
 private slots:
 	void doStart();
 
 private:
-	virtual void OnRecvBufferFull();
-	virtual void OnH264Data(VideoData *video);
-	virtual void OnAudioData(AudioData *audio);
-	virtual void OnMetadata(Metadata *meta);
-	virtual void OnDisconnected();
-	virtual void OnConnectionConnected();
-	virtual void OnException(Message *exception);
-
 	std::mutex statusLock;
 	bool running;
+	bool shared;
 	std::string ip;
 	uint32_t bufferSize;
-	QString ssp_connector_path;
-
-	os_process_pipe_t *pipe;
-
-	std::thread worker;
 
-	imf::OnRecvBufferFullCallback bufferFullCallback;
-	imf::OnH264DataCallback h264DataCallback;
-	imf::OnAudioDataCallback audioDataCallback;
-	imf::OnConnectionConnectedCallback connectedCallback;
-	imf::OnDisconnectedCallback disconnectedCallback;
-	imf::OnMetaCallback metaCallback;
-	imf::OnExceptionCallback exceptionCallback;
+	SSPConnector *connector;
+	uint32_t streamId;
 };
 
 #endif //OBS_SSP_SSP_CLIENT_ISO_H
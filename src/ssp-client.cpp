@@ -0,0 +1,86 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <obs.h>
+
+#include "obs-ssp.h"
+#include "ssp-client.h"
+
+static void convert_metadata(const Metadata *metadata,
+			     struct imf::SspVideoMeta *vmeta,
+			     struct imf::SspAudioMeta *ameta,
+			     struct imf::SspMeta *meta)
+{
+	ameta->bitrate = metadata->ameta.bitrate;
+	ameta->channel = metadata->ameta.channel;
+	ameta->encoder = metadata->ameta.encoder;
+	ameta->sample_rate = metadata->ameta.sample_rate;
+	ameta->sample_size = metadata->ameta.sample_size;
+	ameta->timescale = metadata->ameta.timescale;
+	ameta->unit = metadata->ameta.unit;
+
+	vmeta->encoder = metadata->vmeta.encoder;
+	vmeta->gop = metadata->vmeta.gop;
+	vmeta->height = metadata->vmeta.height;
+	vmeta->timescale = metadata->vmeta.timescale;
+	vmeta->unit = metadata->vmeta.unit;
+	vmeta->width = metadata->vmeta.width;
+
+	meta->pts_is_wall_clock = metadata->meta.pts_is_wall_clock;
+	meta->tc_drop_frame = metadata->meta.tc_drop_frame;
+	meta->timecode = metadata->meta.timecode;
+}
+
+void SSPClient::Dispatch(SSPBuffer *buffer)
+{
+	auto msg = (Message *)buffer->data;
+	switch (msg->type) {
+	case MessageType::MetaDataMsg: {
+		struct imf::SspVideoMeta vmeta;
+		struct imf::SspAudioMeta ameta;
+		struct imf::SspMeta meta;
+		convert_metadata((Metadata *)msg->value, &vmeta, &ameta, &meta);
+		this->metaCallback(&vmeta, &ameta, &meta);
+		break;
+	}
+	case MessageType::VideoDataMsg:
+		this->videoBufferCallback((VideoData *)msg->value, buffer);
+		break;
+	case MessageType::AudioDataMsg:
+		this->audioBufferCallback((AudioData *)msg->value, buffer);
+		break;
+	case MessageType::RecvBufferFullMsg:
+		this->bufferFullCallback();
+		break;
+	case MessageType::DisconnectMsg:
+		this->disconnectedCallback();
+		break;
+	case MessageType::ConnectionConnectedMsg:
+		this->connectedCallback();
+		break;
+	case MessageType::ExceptionMsg: {
+		auto exception = (Message *)msg->value;
+		this->exceptionCallback(exception->type,
+					(char *)exception->value);
+		break;
+	}
+	default:
+		blog(LOG_WARNING, "Protocol error !");
+		break;
+	}
+}
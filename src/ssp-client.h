@@ -0,0 +1,99 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_CLIENT_H
+#define OBS_SSP_SSP_CLIENT_H
+#include <functional>
+#include <string>
+
+#include <imf/ISspClient.h>
+#include <ssp_connector_proto.h>
+#include "ssp-buffer-pool.h"
+
+typedef std::function<void(VideoData *video, SSPBuffer *buffer)>
+	OnVideoBufferCallback;
+typedef std::function<void(AudioData *audio, SSPBuffer *buffer)>
+	OnAudioBufferCallback;
+
+/* Common interface of the ways we can talk to a camera: through an isolated
+ * ssp-connector process, or with libssp loaded in-process. Video and audio
+ * are always delivered as VideoData/AudioData records in pooled buffers. */
+class SSPClient {
+public:
+	virtual ~SSPClient() = default;
+
+	virtual void Start() = 0;
+	virtual void Stop() = 0;
+	virtual void Restart() = 0;
+	// return video frames the consumer is done with to the sender's window
+	virtual void GrantCredits(uint32_t frames) {}
+
+	// frames allowed in flight, 0 when there is no flow control
+	void setCreditWindow(uint32_t frames) { creditWindow = frames; }
+	// imf::STREAM_DEFAULT/STREAM_MAIN/STREAM_SEC
+	void setStreamStyle(int style) { streamStyle = style; }
+	// drop video before it is handed to us, only audio is delivered
+	void setAudioOnly(bool enable) { audioOnly = enable; }
+
+	void setOnRecvBufferFullCallback(const imf::OnRecvBufferFullCallback &cb)
+	{
+		bufferFullCallback = cb;
+	}
+	void setOnVideoBufferCallback(const OnVideoBufferCallback &cb)
+	{
+		videoBufferCallback = cb;
+	}
+	void setOnAudioBufferCallback(const OnAudioBufferCallback &cb)
+	{
+		audioBufferCallback = cb;
+	}
+	void setOnMetaCallback(const imf::OnMetaCallback &cb)
+	{
+		metaCallback = cb;
+	}
+	void setOnDisconnectedCallback(const imf::OnDisconnectedCallback &cb)
+	{
+		disconnectedCallback = cb;
+	}
+	void setOnConnectionConnectedCallback(
+		const imf::OnConnectionConnectedCallback &cb)
+	{
+		connectedCallback = cb;
+	}
+	void setOnExceptionCallback(const imf::OnExceptionCallback &cb)
+	{
+		exceptionCallback = cb;
+	}
+
+	// hand a message received from ssp-connector to the callbacks
+	void Dispatch(SSPBuffer *buffer);
+
+protected:
+	imf::OnRecvBufferFullCallback bufferFullCallback;
+	OnVideoBufferCallback videoBufferCallback;
+	OnAudioBufferCallback audioBufferCallback;
+	imf::OnConnectionConnectedCallback connectedCallback;
+	imf::OnDisconnectedCallback disconnectedCallback;
+	imf::OnMetaCallback metaCallback;
+	imf::OnExceptionCallback exceptionCallback;
+	uint32_t creditWindow = 0;
+	int streamStyle = imf::STREAM_DEFAULT;
+	bool audioOnly = false;
+};
+
+#endif //OBS_SSP_SSP_CLIENT_H
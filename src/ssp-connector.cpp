@@ -0,0 +1,657 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <obs.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+#if defined(__APPLE__)
+#include <dlfcn.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+#include <QFileInfo>
+#include <QDir>
+
+#include "obs-ssp.h"
+#include "ssp-connector.h"
+
+static std::mutex connectorsLock;
+static std::vector<SSPConnector *> connectors;
+static std::thread spawner;
+static bool spawning = false;
+/* Held from creating the fds a connector inherits until the parent closed
+ * its copy of them, so connectors spawned at the same time by the spare
+ * thread never inherit each other's control pipe or ring. */
+static std::mutex spawnLock;
+
+static size_t os_process_pipe_read_retry(os_process_pipe *pipe, uint8_t *dst,
+					 size_t size)
+{
+	size_t pos = 0, cur = 0;
+	while (pos < size) {
+		cur = os_process_pipe_read(pipe, dst + pos, size - pos);
+		if (!cur) {
+			break;
+		}
+		pos += cur;
+	}
+	return pos;
+}
+
+#define MSG_MAX_LENGTH (256 * 1024 * 1024)
+
+static SSPBuffer *msg_recv(os_process_pipe *pipe, uint32_t *streamId)
+{
+	size_t sz = 0;
+	MuxHeader mux;
+	Message header;
+	sz = os_process_pipe_read_retry(pipe, (uint8_t *)&mux, sizeof(mux));
+	if (sz != sizeof(mux)) {
+		ssp_blog(LOG_WARNING, "pipe protocol mux header error, recv: %d!",
+			 sz);
+		return nullptr;
+	}
+	*streamId = mux.stream_id;
+	sz = os_process_pipe_read_retry(pipe, (uint8_t *)&header,
+					sizeof(Message));
+	if (sz != sizeof(Message)) {
+		ssp_blog(LOG_WARNING, "pipe protocol header error, recv: %d!",
+			 sz);
+		return nullptr;
+	}
+	if (header.length > MSG_MAX_LENGTH) {
+		ssp_blog(LOG_WARNING, "pipe protocol length error: %u!",
+			 header.length);
+		return nullptr;
+	}
+	auto buf = SSPBufferPool::global()->acquire(sizeof(Message) +
+						     header.length);
+	memcpy(buf->data, &header, sizeof(Message));
+	if (header.length == 0) {
+		return buf;
+	}
+	sz = os_process_pipe_read_retry(pipe, buf->data + sizeof(Message),
+					header.length);
+	if (sz != header.length) {
+		ssp_blog(LOG_WARNING, "pipe protocol body error, recv: %d!",
+			 sz);
+		buf->release();
+		return nullptr;
+	}
+	return buf;
+}
+
+static void msg_free(SSPBuffer *buf)
+{
+	if (buf) {
+		buf->release();
+	}
+}
+
+static void *dump_stderr(os_process_pipe *pipe)
+{
+	size_t sz;
+	char buf[1024];
+	while (true) {
+		sz = os_process_pipe_read_err(pipe, (uint8_t *)buf,
+					      sizeof(buf) - 1);
+		if (sz == 0) {
+			break;
+		}
+		buf[sz] = '\0';
+		ssp_blog(LOG_INFO, "%s", buf);
+	}
+	ssp_blog(LOG_INFO, "read thread exited");
+	return nullptr;
+}
+
+static QString connector_path()
+{
+#if defined(__APPLE__)
+	Dl_info info;
+	dladdr((const void *)msg_free, &info);
+	QFileInfo plugin_path(info.dli_fname);
+	return plugin_path.dir().filePath(QStringLiteral(SSP_CONNECTOR));
+#else
+	return QStringLiteral(SSP_CONNECTOR);
+#endif
+}
+
+SSPConnector *SSPConnector::Acquire(bool shared)
+{
+	std::vector<SSPConnector *> dead;
+	SSPConnector *found = nullptr;
+	int capacity = shared ? SSP_CONNECTOR_MAX_STREAMS : 1;
+	{
+		std::lock_guard<std::mutex> locker(connectorsLock);
+		for (auto it = connectors.begin(); it != connectors.end();) {
+			auto connector = *it;
+			// idle connectors whose process went away
+			if (!connector->running && connector->users == 0) {
+				dead.push_back(connector);
+				it = connectors.erase(it);
+				continue;
+			}
+			if (!found && connector->running &&
+			    connector->capacity == capacity &&
+			    connector->users < capacity) {
+				found = connector;
+			}
+			++it;
+		}
+		if (found) {
+			if (found->users == 0) {
+				blog(LOG_INFO, "using warm ssp-connector");
+			}
+			found->users++;
+		}
+	}
+	for (auto connector : dead) {
+		connector->Shutdown();
+		delete connector;
+	}
+
+	if (!found) {
+		found = new SSPConnector(capacity);
+		if (!found->Spawn()) {
+			delete found;
+			return nullptr;
+		}
+		std::lock_guard<std::mutex> locker(connectorsLock);
+		found->users = 1;
+		connectors.push_back(found);
+	}
+	if (!shared) {
+		RefillSpares();
+	}
+	return found;
+}
+
+void SSPConnector::Release(SSPConnector *connector)
+{
+	{
+		std::lock_guard<std::mutex> locker(connectorsLock);
+		if (--connector->users > 0) {
+			return;
+		}
+		if (KeepWarm(connector)) {
+			return;
+		}
+		auto it = std::find(connectors.begin(), connectors.end(),
+				    connector);
+		if (it != connectors.end()) {
+			connectors.erase(it);
+		}
+	}
+	connector->Shutdown();
+	delete connector;
+}
+
+/* Called with connectorsLock held and the connector idle. Keep one idle
+ * shared connector, and up to SSP_CONNECTOR_WARM_SPARES isolated ones. */
+bool SSPConnector::KeepWarm(SSPConnector *connector)
+{
+	if (!connector->running) {
+		return false;
+	}
+	int idle = 0;
+	for (auto other : connectors) {
+		if (other != connector && other->users == 0 &&
+		    other->running && other->capacity == connector->capacity) {
+			++idle;
+		}
+	}
+	return connector->capacity > 1 ? idle == 0
+				       : idle < SSP_CONNECTOR_WARM_SPARES;
+}
+
+void SSPConnector::SpawnSpare()
+{
+	auto connector = new SSPConnector(1);
+	bool ok = connector->Spawn();
+	std::unique_lock<std::mutex> locker(connectorsLock);
+	if (ok && KeepWarm(connector)) {
+		connectors.push_back(connector);
+		connector = nullptr;
+	}
+	spawning = false;
+	locker.unlock();
+
+	if (connector) {
+		if (ok) {
+			connector->Shutdown();
+		}
+		delete connector;
+	}
+}
+
+void SSPConnector::RefillSpares()
+{
+	std::lock_guard<std::mutex> locker(connectorsLock);
+	if (spawning) {
+		return;
+	}
+	int idle = 0;
+	for (auto connector : connectors) {
+		if (connector->users == 0 && connector->running &&
+		    connector->capacity == 1) {
+			++idle;
+		}
+	}
+	if (idle >= SSP_CONNECTOR_WARM_SPARES) {
+		return;
+	}
+	// the previous spawner is done, it cleared spawning as it finished
+	if (spawner.joinable()) {
+		spawner.join();
+	}
+	spawning = true;
+	spawner = std::thread(SpawnSpare);
+}
+
+void SSPConnector::Prewarm()
+{
+	RefillSpares();
+}
+
+void SSPConnector::ShutdownAll()
+{
+	std::vector<SSPConnector *> list;
+	if (spawner.joinable()) {
+		spawner.join();
+	}
+	{
+		std::lock_guard<std::mutex> locker(connectorsLock);
+		list.swap(connectors);
+	}
+	for (auto connector : list) {
+		connector->Shutdown();
+		delete connector;
+	}
+}
+
+SSPConnector::SSPConnector(int capacity)
+{
+	this->capacity = capacity;
+	this->users = 0;
+	this->running = false;
+	this->nextStreamId = SSP_MUX_CONNECTOR_STREAM + 1;
+	this->dispatching = SSP_MUX_CONNECTOR_STREAM;
+#ifdef _WIN32
+	this->ctrlHandle = nullptr;
+	this->ctrlChildHandle = nullptr;
+#else
+	this->ctrlFd = -1;
+	this->ctrlChildFd = -1;
+#endif
+	this->pipe = nullptr;
+	this->ring = nullptr;
+}
+
+SSPConnector::~SSPConnector()
+{
+	CloseControlPipe();
+	DestroyShmRing();
+}
+
+bool SSPConnector::CreateShmRing()
+{
+	this->ring = SSPShmRing::Create(SSP_SHM_DEFAULT_SIZE);
+	return this->ring != nullptr;
+}
+
+// frames still referencing the ring keep it mapped until they are released
+void SSPConnector::DestroyShmRing()
+{
+	if (this->ring) {
+		this->ring->release();
+		this->ring = nullptr;
+	}
+}
+
+bool SSPConnector::CreateControlPipe(long long *childEnd)
+{
+#ifdef _WIN32
+	SECURITY_ATTRIBUTES sa = {sizeof(sa), nullptr, TRUE};
+	HANDLE rd, wr;
+	if (!CreatePipe(&rd, &wr, &sa, 0)) {
+		return false;
+	}
+	// only the read end goes to the connector
+	SetHandleInformation(wr, HANDLE_FLAG_INHERIT, 0);
+	this->ctrlHandle = wr;
+	this->ctrlChildHandle = rd;
+	*childEnd = (long long)(intptr_t)rd;
+#else
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		return false;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	this->ctrlFd = fds[0];
+	this->ctrlChildFd = fds[1];
+	*childEnd = fds[1];
+#endif
+	return true;
+}
+
+void SSPConnector::CloseControlPipe()
+{
+	std::lock_guard<std::mutex> locker(ctrlLock);
+#ifdef _WIN32
+	if (this->ctrlChildHandle) {
+		CloseHandle(this->ctrlChildHandle);
+		this->ctrlChildHandle = nullptr;
+	}
+	if (this->ctrlHandle) {
+		CloseHandle(this->ctrlHandle);
+		this->ctrlHandle = nullptr;
+	}
+#else
+	if (this->ctrlChildFd >= 0) {
+		close(this->ctrlChildFd);
+		this->ctrlChildFd = -1;
+	}
+	if (this->ctrlFd >= 0) {
+		close(this->ctrlFd);
+		this->ctrlFd = -1;
+	}
+#endif
+}
+
+bool SSPConnector::SendControl(ControlType type, const void *value,
+			       uint32_t length)
+{
+	std::vector<uint8_t> buf(sizeof(Message) + length);
+	auto msg = (Message *)buf.data();
+	msg->type = type;
+	msg->length = length;
+	memcpy(msg->value, value, length);
+
+	std::lock_guard<std::mutex> locker(ctrlLock);
+	size_t pos = 0;
+	while (pos < buf.size()) {
+#ifdef _WIN32
+		DWORD written = 0;
+		if (!this->ctrlHandle ||
+		    !WriteFile(this->ctrlHandle, buf.data() + pos,
+			       (DWORD)(buf.size() - pos), &written, nullptr)) {
+			return false;
+		}
+#else
+#ifdef MSG_NOSIGNAL
+		int flags = MSG_NOSIGNAL;
+#else
+		int flags = 0;
+#endif
+		if (this->ctrlFd < 0) {
+			return false;
+		}
+		ssize_t written = send(this->ctrlFd, buf.data() + pos,
+				       buf.size() - pos, flags);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+#endif
+		pos += written;
+	}
+	return true;
+}
+
+bool SSPConnector::Spawn()
+{
+	struct dstr cmd;
+	long long ctrlChild;
+
+	std::unique_lock<std::mutex> spawnLocker(spawnLock);
+	if (!CreateControlPipe(&ctrlChild)) {
+		blog(LOG_WARNING, "Create ssp-connector control pipe failed.");
+		return false;
+	}
+
+	dstr_init_copy(&cmd, connector_path().toStdString().c_str());
+	dstr_insert_ch(&cmd, 0, '\"');
+	dstr_cat(&cmd, "\" ");
+#if defined(__APPLE__) && defined(__arm64__)
+	dstr_insert(&cmd, 0, "arch -x86_64 ");
+#endif
+	dstr_catf(&cmd, "--mux --ctrl-fd %lld", ctrlChild);
+
+	bool use_shm = CreateShmRing();
+	if (use_shm) {
+		dstr_catf(&cmd, " --shm-fd %d --shm-size %zu", this->ring->fd(),
+			  this->ring->size());
+	}
+
+#ifndef _WIN32
+	// these must only be inherited by the connector we spawn here
+	fcntl(this->ctrlChildFd, F_SETFD, 0);
+	if (use_shm) {
+		fcntl(this->ring->fd(), F_SETFD, 0);
+	}
+#endif
+	auto tpipe = os_process_pipe_create(cmd.array, "r");
+#ifndef _WIN32
+	fcntl(this->ctrlChildFd, F_SETFD, FD_CLOEXEC);
+	if (use_shm) {
+		fcntl(this->ring->fd(), F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	blog(LOG_INFO, "Start ssp-connector at: %s", cmd.array);
+	dstr_free(&cmd);
+
+	// the child holds its own copy of the control read end now
+#ifdef _WIN32
+	CloseHandle(this->ctrlChildHandle);
+	this->ctrlChildHandle = nullptr;
+#else
+	close(this->ctrlChildFd);
+	this->ctrlChildFd = -1;
+#endif
+	spawnLocker.unlock();
+
+	if (!tpipe) {
+		blog(LOG_WARNING, "Start ssp-connector failed.");
+		CloseControlPipe();
+		DestroyShmRing();
+		return false;
+	}
+	this->pipe = tpipe;
+	this->running = true;
+	this->worker = std::thread(&SSPConnector::ReceiveLoop, this);
+	return true;
+}
+
+void SSPConnector::Shutdown()
+{
+	blog(LOG_INFO, "ssp-connector stopping...");
+	this->running = false;
+	// the connector exits once its control pipe is closed
+	CloseControlPipe();
+	if (this->worker.joinable()) {
+		this->worker.join();
+	}
+	if (this->pipe) {
+		os_process_pipe_destroy(this->pipe);
+		this->pipe = nullptr;
+	}
+	DestroyShmRing();
+	SSPBufferPool::global()->logStats("ssp-connector");
+}
+
+uint32_t SSPConnector::Open(const std::string &ip, uint32_t bufferSize,
+			    uint32_t creditWindow, int streamStyle,
+			    bool audioOnly, SSPClient *client)
+{
+	ControlOpen open = {};
+	{
+		std::lock_guard<std::mutex> locker(streamLock);
+		open.stream_id = this->nextStreamId++;
+		this->streams[open.stream_id] = client;
+	}
+	open.port = 9999;
+	open.buffer_size = bufferSize;
+	open.credit_window = creditWindow;
+	open.stream_style = streamStyle;
+	open.flags = audioOnly ? SSP_OPEN_AUDIO_ONLY : 0;
+	strncpy(open.host, ip.c_str(), sizeof(open.host) - 1);
+
+	if (!SendControl(CtrlOpenMsg, &open, sizeof(open))) {
+		blog(LOG_WARNING, "ssp-connector control pipe is gone.");
+		std::lock_guard<std::mutex> locker(streamLock);
+		this->streams.erase(open.stream_id);
+		return 0;
+	}
+	return open.stream_id;
+}
+
+void SSPConnector::Close(uint32_t streamId)
+{
+	ControlClose close = {streamId};
+	SendControl(CtrlCloseMsg, &close, sizeof(close));
+	// no callback of the stream runs once it is out of the map and the
+	// receive thread is done with it, unless that is who closes it
+	std::unique_lock<std::mutex> locker(streamLock);
+	this->streams.erase(streamId);
+	if (std::this_thread::get_id() != this->worker.get_id()) {
+		dispatchDone.wait(locker, [this, streamId]() {
+			return this->dispatching != streamId;
+		});
+	}
+}
+
+void SSPConnector::Grant(uint32_t streamId, uint32_t credits)
+{
+	ControlCredit credit = {streamId, credits};
+	SendControl(CtrlCreditMsg, &credit, sizeof(credit));
+}
+
+void SSPConnector::ReceiveLoop()
+{
+	auto pool = SSPBufferPool::global();
+	uint32_t streamId;
+	SSPBuffer *buf;
+	Message *msg;
+
+#ifdef _WIN32
+	std::thread(dump_stderr, this->pipe).detach();
+#endif
+
+	buf = msg_recv(this->pipe, &streamId);
+	if (!buf) {
+		blog(LOG_WARNING, "Receive error !");
+		this->running = false;
+		return;
+	}
+	msg = (Message *)buf->data;
+	if (msg->type != MessageType::ConnectorOkMsg) {
+		blog(LOG_WARNING, "Protocol error !");
+		msg_free(buf);
+		this->running = false;
+		return;
+	}
+	msg_free(buf);
+
+	while (this->running) {
+		buf = msg_recv(this->pipe, &streamId);
+		if (!buf) {
+			break;
+		}
+
+		msg = (Message *)buf->data;
+		if (msg->type == MessageType::ShmDataMsg) {
+			auto ref = (ShmDataRef *)msg->value;
+			SSPBuffer *rec = nullptr;
+			if (this->ring && msg->length == sizeof(*ref)) {
+				rec = this->ring->Wrap(ref);
+			}
+			if (!rec) {
+				blog(LOG_WARNING, "Shm ring protocol error !");
+				msg_free(buf);
+				break;
+			}
+			// decoded in place, freed with its last reference
+			msg_free(buf);
+			buf = rec;
+		}
+
+		Dispatch(streamId, buf);
+		msg_free(buf);
+	}
+
+	if (!this->running) {
+		return;
+	}
+	// the connector died under us, let every camera on it reconnect
+	blog(LOG_WARNING, "Receive error !");
+	this->running = false;
+	buf = pool->acquire(sizeof(Message));
+	msg = (Message *)buf->data;
+	msg->type = MessageType::DisconnectMsg;
+	msg->length = 0;
+	std::vector<uint32_t> ids;
+	{
+		std::lock_guard<std::mutex> locker(streamLock);
+		for (auto &it : this->streams) {
+			ids.push_back(it.first);
+		}
+	}
+	for (auto id : ids) {
+		Dispatch(id, buf);
+	}
+	msg_free(buf);
+}
+
+/* The callbacks run without streamLock, so a slow consumer of one stream does
+ * not hold up Open and Close of the others. Close waits for them instead. */
+void SSPConnector::Dispatch(uint32_t streamId, SSPBuffer *buf)
+{
+	SSPClient *client;
+	{
+		std::lock_guard<std::mutex> locker(streamLock);
+		auto it = this->streams.find(streamId);
+		if (it == this->streams.end()) {
+			return;
+		}
+		client = it->second;
+		this->dispatching = streamId;
+	}
+	client->Dispatch(buf);
+	std::lock_guard<std::mutex> locker(streamLock);
+	this->dispatching = SSP_MUX_CONNECTOR_STREAM;
+	dispatchDone.notify_all();
+}
@@ -0,0 +1,111 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_CONNECTOR_H
+#define OBS_SSP_SSP_CONNECTOR_H
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <util/pipe.h>
+}
+#include <ssp_connector_proto.h>
+#include "ssp-client.h"
+#include "ssp-shm-ring.h"
+
+#ifdef _WIN64
+#define SSP_CONNECTOR "../../obs-plugins/" OBS_SSP_BITSTR "/ssp-connector.exe"
+#else
+#define SSP_CONNECTOR "ssp-connector"
+#endif
+
+// streams a shared connector serves before another process is spawned
+#define SSP_CONNECTOR_MAX_STREAMS 16
+// idle isolated connectors kept started, ready to take a camera at once
+#define SSP_CONNECTOR_WARM_SPARES 1
+
+/* An ssp-connector process running in mux mode. Cameras are opened on it
+ * as streams over the control pipe, and its output is demultiplexed by
+ * stream id to the SSPClient that owns each stream. An isolated connector
+ * carries a single stream, a shared one up to SSP_CONNECTOR_MAX_STREAMS.
+ *
+ * Released connectors are not stopped right away: a few idle ones are kept
+ * warm, and a spare isolated one is spawned in the background whenever one
+ * is taken, so new sources and reconnects skip the process startup. */
+class SSPConnector {
+public:
+	static SSPConnector *Acquire(bool shared);
+	static void Release(SSPConnector *connector);
+	static void ShutdownAll();
+	static void Prewarm();
+
+	uint32_t Open(const std::string &ip, uint32_t bufferSize,
+		      uint32_t creditWindow, int streamStyle, bool audioOnly,
+		      SSPClient *client);
+	void Close(uint32_t streamId);
+	void Grant(uint32_t streamId, uint32_t credits);
+
+private:
+	explicit SSPConnector(int capacity);
+	~SSPConnector();
+
+	static bool KeepWarm(SSPConnector *connector);
+	static void RefillSpares();
+	static void SpawnSpare();
+
+	bool Spawn();
+	void Shutdown();
+	bool CreateShmRing();
+	void DestroyShmRing();
+	bool CreateControlPipe(long long *childEnd);
+	void CloseControlPipe();
+	bool SendControl(ControlType type, const void *value, uint32_t length);
+	void ReceiveLoop();
+	void Dispatch(uint32_t streamId, SSPBuffer *buf);
+
+	int capacity;
+	int users;
+	std::atomic<bool> running;
+	uint32_t nextStreamId;
+
+	std::mutex streamLock;
+	std::map<uint32_t, SSPClient *> streams;
+	// stream whose callbacks the receive thread runs right now, 0 if none
+	uint32_t dispatching;
+	std::condition_variable dispatchDone;
+
+	std::mutex ctrlLock;
+#ifdef _WIN32
+	void *ctrlHandle;
+	void *ctrlChildHandle;
+#else
+	int ctrlFd;
+	int ctrlChildFd;
+#endif
+
+	os_process_pipe_t *pipe;
+	SSPShmRing *ring;
+
+	std::thread worker;
+};
+
+#endif //OBS_SSP_SSP_CONNECTOR_H
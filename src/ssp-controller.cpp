@@ -16,6 +16,8 @@ You should have received a copy of the GNU General Public License
 along with this program; If not, see <https://www.gnu.org/licenses/>
 */
 
+#include <memory>
+#include <vector>
 #include <QMetaType>
 #include "ssp-controller.h"
 #include <obs-module.h>
@@ -28,10 +30,10 @@ CameraStatus::CameraStatus() : QObject()
 	qRegisterMetaType<StatusReasonUpdateCallback>(
 		"StatusReasonUpdateCallback");
 	connect(this,
-		SIGNAL(onSetStream(int, QString, bool, QString, int,
+		SIGNAL(onSetStream(int, QString, bool, QString, int, int,
 				   StatusReasonUpdateCallback)),
 		this,
-		SLOT(doSetStream(int, QString, bool, QString, int,
+		SLOT(doSetStream(int, QString, bool, QString, int, int,
 				 StatusReasonUpdateCallback)));
 	connect(this, SIGNAL(onSetLed(bool)), this, SLOT(doSetLed(bool)));
 	connect(this, SIGNAL(onRefresh(StatusUpdateCallback)), this,
@@ -148,18 +150,37 @@ void CameraStatus::doSetLed(bool isOn)
 
 void CameraStatus::setStream(int stream_index, QString resolution,
 			     bool low_noise, QString fps, int bitrate,
-			     StatusReasonUpdateCallback cb)
+			     int changes, StatusReasonUpdateCallback cb)
 {
 	blog(LOG_INFO, "In ::setStream emitting onSetStream");
-	emit onSetStream(stream_index, resolution, low_noise, fps, bitrate, cb);
+	emit onSetStream(stream_index, resolution, low_noise, fps, bitrate,
+			 changes, cb);
+}
+
+/* One camera request of setStream, it calls next when it succeeded and cb
+ * with the reason when it did not. */
+typedef std::function<void(const std::function<void()> &next)> StreamStep;
+
+static void run_stream_steps(std::shared_ptr<std::vector<StreamStep>> steps,
+			     size_t i, const StatusReasonUpdateCallback &cb)
+{
+	if (i == steps->size()) {
+		return cb(true, "Success");
+	}
+	(*steps)[i]([=]() { run_stream_steps(steps, i + 1, cb); });
+}
+
+static bool request_failed(HttpResponse *rsp)
+{
+	return rsp->statusCode != 200 || rsp->code != 0;
 }
 
 void CameraStatus::doSetStream(int stream_index, QString resolution,
 			       bool low_noise, QString fps, int bitrate,
-			       StatusReasonUpdateCallback cb)
+			       int changes, StatusReasonUpdateCallback cb)
 {
 	bool need_downresolution = false;
-	blog(LOG_INFO, "In doSetStream");
+	blog(LOG_INFO, "In doSetStream, changes 0x%x", changes);
 	if (model.contains(E2C_MODEL_CODE, Qt::CaseInsensitive)) {
 		if (resolution != "1920*1080" && fps.toDouble() > 30) {
 			return cb(
@@ -173,11 +194,14 @@ void CameraStatus::doSetStream(int stream_index, QString resolution,
 	auto bitrate2 = QString::number(bitrate);
 
 	if (model.contains(IPMANS_MODEL_CODE, Qt::CaseInsensitive)) {
+		if (!(changes & SSP_STREAM_SET_BITRATE)) {
+			return cb(true, "Success");
+		}
 		auto index =
 			QString("stream") + QString::number(stream_index + 1);
 		controller->setStreamBitrate(
 			index, bitrate2, [=](HttpResponse *rsp) {
-				if (rsp->statusCode != 200 || rsp->code != 0) {
+				if (request_failed(rsp)) {
 					return cb(
 						false,
 						QString("Could not set bitrate to %1")
@@ -214,77 +238,95 @@ void CameraStatus::doSetStream(int stream_index, QString resolution,
 	}
 
 	auto index = QString("Stream") + QString::number(stream_index);
-	blog(LOG_INFO, "Setting movie resolution");
-	controller->setCameraConfig(CONFIG_KEY_MOVIE_RESOLUTION, real_resolution, [=](HttpResponse *rsp) {
-		if (rsp->statusCode != 200 || rsp->code != 0) {
-			return cb(
-				false,
-				QString("Failed to set movie resolution to %1")
-					.arg(real_resolution));
-		}
-		blog(LOG_INFO, "Setting fps");
-		controller->setCameraConfig(CONFIG_KEY_PROJECT_FPS, fps, [=](HttpResponse *rsp) {
-			if (rsp->statusCode != 200 || rsp->code != 0) {
-				return cb(false,
-					  QString("Failed to set fps to %1")
-						  .arg(fps));
-			}
-			blog(LOG_INFO, "Setting encoder");
-			controller->setCameraConfig(CONFIG_KEY_VIDEO_ENCODER, "H.265", [=](HttpResponse *rsp) {
-				blog(LOG_INFO, "Setting sendStream");
-
-				controller->setSendStream(index, [=](HttpResponse
-									     *rsp) {
-					if (rsp->statusCode != 200 ||
-					    rsp->code != 0) {
+	auto steps = std::make_shared<std::vector<StreamStep>>();
+	// the camera caps fps by resolution, the resolution goes first
+	if (changes & (SSP_STREAM_SET_RESOLUTION | SSP_STREAM_SET_FPS)) {
+		steps->push_back([=](const std::function<void()> &next) {
+			blog(LOG_INFO, "Setting movie resolution");
+			controller->setCameraConfig(
+				CONFIG_KEY_MOVIE_RESOLUTION, real_resolution,
+				[=](HttpResponse *rsp) {
+					if (request_failed(rsp)) {
+						return cb(
+							false,
+							QString("Failed to set movie resolution to %1")
+								.arg(real_resolution));
+					}
+					next();
+				});
+		});
+	}
+	if (changes & SSP_STREAM_SET_FPS) {
+		steps->push_back([=](const std::function<void()> &next) {
+			blog(LOG_INFO, "Setting fps");
+			controller->setCameraConfig(
+				CONFIG_KEY_PROJECT_FPS, fps,
+				[=](HttpResponse *rsp) {
+					if (request_failed(rsp)) {
 						return cb(
 							false,
-							QString("Could not set video encoder to H.265"));
+							QString("Failed to set fps to %1")
+								.arg(fps));
 					}
-					blog(LOG_INFO,
-					     "Setting bitrate andn gop");
-					controller->setStreamBitrateAndGop(
-						index.toLower(), bitrate2, "10",
-						[=](HttpResponse *rsp) {
-							if (rsp->statusCode !=
-								    200 ||
-							    rsp->code != 0) {
-								return cb(
-									false,
-									QString("Could not set bitrate to %1 or GOP to 10")
-										.arg(bitrate2));
-							}
-							if (stream_index == 0) {
-								return cb(
-									true,
-									"Success");
-							}
-							blog(LOG_INFO,
-							     "Setting stream resolution");
-							controller->setStreamResolution(
-								index.toLower(),
-								width, height,
-								[=](HttpResponse
-									    *rsp) {
-									if (rsp->statusCode !=
-										    200 ||
-									    rsp->code !=
-										    0) {
-										return cb(
-											false,
-											QString("Could not set stream resolution to %1 x %2")
-												.arg(width)
-												.arg(height));
-									}
-									return cb(
-										true,
-										"Success");
-								});
-						});
+					next();
 				});
+		});
+	}
+	if (changes & SSP_STREAM_SET_ENCODER) {
+		steps->push_back([=](const std::function<void()> &next) {
+			blog(LOG_INFO, "Setting encoder");
+			controller->setCameraConfig(
+				CONFIG_KEY_VIDEO_ENCODER, "H.265",
+				[=](HttpResponse *rsp) { next(); });
+		});
+		steps->push_back([=](const std::function<void()> &next) {
+			blog(LOG_INFO, "Setting sendStream");
+			controller->setSendStream(index, [=](HttpResponse *rsp) {
+				if (request_failed(rsp)) {
+					return cb(
+						false,
+						QString("Could not set video encoder to H.265"));
+				}
+				next();
 			});
 		});
-	});
+	}
+	if (changes & SSP_STREAM_SET_BITRATE) {
+		steps->push_back([=](const std::function<void()> &next) {
+			blog(LOG_INFO, "Setting bitrate andn gop");
+			controller->setStreamBitrateAndGop(
+				index.toLower(), bitrate2, "10",
+				[=](HttpResponse *rsp) {
+					if (request_failed(rsp)) {
+						return cb(
+							false,
+							QString("Could not set bitrate to %1 or GOP to 10")
+								.arg(bitrate2));
+					}
+					next();
+				});
+		});
+	}
+	// stream 0 always runs at the movie resolution
+	if (stream_index != 0 &&
+	    (changes & (SSP_STREAM_SET_RESOLUTION | SSP_STREAM_SET_ENCODER))) {
+		steps->push_back([=](const std::function<void()> &next) {
+			blog(LOG_INFO, "Setting stream resolution");
+			controller->setStreamResolution(
+				index.toLower(), width, height,
+				[=](HttpResponse *rsp) {
+					if (request_failed(rsp)) {
+						return cb(
+							false,
+							QString("Could not set stream resolution to %1 x %2")
+								.arg(width)
+								.arg(height));
+					}
+					next();
+				});
+		});
+	}
+	run_stream_steps(steps, 0, cb);
 }
 
 CameraStatus::~CameraStatus()
@@ -26,6 +26,13 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #define E2C_MODEL_CODE "elephant"
 #define IPMANS_MODEL_CODE "wlm"
 
+// what setStream sends to the camera, the calls for the rest are skipped
+#define SSP_STREAM_SET_RESOLUTION 0x01
+#define SSP_STREAM_SET_FPS 0x02
+#define SSP_STREAM_SET_ENCODER 0x04
+#define SSP_STREAM_SET_BITRATE 0x08
+#define SSP_STREAM_SET_ALL 0x0f
+
 typedef std::function<void(bool ok)> StatusUpdateCallback;
 typedef std::function<void(bool ok, QString)> StatusReasonUpdateCallback;
 
@@ -52,17 +59,18 @@ public:
 	QString current_framerate;
 	StreamInfo current_streamInfo;
 	void setStream(int stream_index, QString resolution, bool low_noise,
-		       QString fps, int bitrate, StatusReasonUpdateCallback cb);
+		       QString fps, int bitrate, int changes,
+		       StatusReasonUpdateCallback cb);
 
 signals:
 	void onSetStream(int stream_index, QString resolution, bool low_noise,
-			 QString fps, int bitrate,
+			 QString fps, int bitrate, int changes,
 			 StatusReasonUpdateCallback cb);
 	void onRefresh(StatusUpdateCallback cb);
 	void onSetLed(bool on);
 private slots:
 	void doSetStream(int stream_index, QString resolution, bool low_noise,
-			 QString fps, int bitrate,
+			 QString fps, int bitrate, int changes,
 			 StatusReasonUpdateCallback cb);
 	void doRefresh(StatusUpdateCallback cb);
 	void doSetLed(bool on);
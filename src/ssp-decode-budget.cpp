@@ -0,0 +1,120 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <algorithm>
+#include <obs.h>
+#include <util/platform.h>
+
+#include "obs-ssp.h"
+#include "ssp-decode-budget.h"
+
+SSPDecodeBudget *SSPDecodeBudget::global()
+{
+	static SSPDecodeBudget budget;
+	return &budget;
+}
+
+SSPDecodeBudget::SSPDecodeBudget() : total(os_get_logical_cores()) {}
+
+void SSPDecodeBudget::setBudget(int threads)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	total = threads > 0 ? threads : os_get_logical_cores();
+	rebalance();
+}
+
+SSPDecodeShare *SSPDecodeBudget::join(bool active)
+{
+	auto share = new SSPDecodeShare;
+	share->weight = SSP_DECODE_DEFAULT_WEIGHT;
+	share->active = active;
+	share->threads = 1;
+
+	std::lock_guard<std::mutex> locker(lock);
+	shares.push_back(share);
+	rebalance();
+	return share;
+}
+
+void SSPDecodeBudget::leave(SSPDecodeShare *share)
+{
+	if (!share) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> locker(lock);
+		shares.erase(std::remove(shares.begin(), shares.end(), share),
+			     shares.end());
+		rebalance();
+	}
+	delete share;
+}
+
+void SSPDecodeBudget::setWeight(SSPDecodeShare *share, uint32_t width,
+				uint32_t height, double fps)
+{
+	uint64_t weight = (uint64_t)((double)width * height * fps);
+	if (weight == 0) {
+		weight = SSP_DECODE_DEFAULT_WEIGHT;
+	}
+
+	std::lock_guard<std::mutex> locker(lock);
+	if (share->weight == weight) {
+		return;
+	}
+	share->weight = weight;
+	rebalance();
+}
+
+void SSPDecodeBudget::setActive(SSPDecodeShare *share, bool active)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	if (share->active == active) {
+		return;
+	}
+	share->active = active;
+	rebalance();
+}
+
+void SSPDecodeBudget::rebalance()
+{
+	int active = 0;
+	uint64_t weight = 0;
+	for (auto share : shares) {
+		if (share->active) {
+			active++;
+			weight += share->weight;
+		}
+	}
+
+	// inactive sources keep a single thread, the rest goes by weight
+	int inactive = (int)shares.size() - active;
+	int spare = std::max(active, total - inactive);
+	for (auto share : shares) {
+		int threads = 1;
+		if (share->active && weight) {
+			threads = std::max(1, (int)((double)spare *
+						    share->weight / weight));
+		}
+		share->threads.store(threads, std::memory_order_relaxed);
+	}
+
+	ssp_blog(LOG_INFO,
+		 "decode budget: %d threads over %d sources, %d active", total,
+		 (int)shares.size(), active);
+}
@@ -0,0 +1,64 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_DECODE_BUDGET_H
+#define OBS_SSP_SSP_DECODE_BUDGET_H
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// weight of a source before its stream metadata is known, 1080p30
+#define SSP_DECODE_DEFAULT_WEIGHT (1920ULL * 1080ULL * 30ULL)
+
+/* One source's slice of the decode thread budget. threads is rewritten on
+ * every rebalance, a running decoder is reopened for it at its next IDR once
+ * it is at least twice or half what the decoder was opened with. */
+struct SSPDecodeShare {
+	uint64_t weight;
+	bool active;
+	std::atomic<int> threads;
+};
+
+/* Splits a plugin-wide number of decoder threads across the sources, so many
+ * cameras don't each start a thread per core. Active sources get threads in
+ * proportion to the pixels per second they decode, inactive ones one each. */
+class SSPDecodeBudget {
+public:
+	static SSPDecodeBudget *global();
+
+	SSPDecodeBudget();
+
+	void setBudget(int threads);
+	int budget() const { return total; }
+
+	SSPDecodeShare *join(bool active);
+	void leave(SSPDecodeShare *share);
+	void setWeight(SSPDecodeShare *share, uint32_t width, uint32_t height,
+		       double fps);
+	void setActive(SSPDecodeShare *share, bool active);
+
+private:
+	void rebalance();
+
+	std::mutex lock;
+	int total;
+	std::vector<SSPDecodeShare *> shares;
+};
+
+#endif //OBS_SSP_SSP_DECODE_BUDGET_H
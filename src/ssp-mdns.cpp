@@ -20,9 +20,13 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #define _CRT_SECURE_NO_WARNINGS 1
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <map>
-#include <string>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <vector>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +39,14 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #else
 #include <netdb.h>
 #include <ifaddrs.h>
+#include <net/if.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#elif defined(__APPLE__)
+#include <net/route.h>
 #endif
 
 #include <obs-module.h>
@@ -44,6 +56,7 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 #include "obs-ssp.h"
 #include "ssp-mdns.h"
 
+// until the camera has told us its TTLs
 #define DEFAULT_TTL 60
 
 struct mdns_args {
@@ -52,27 +65,36 @@ struct mdns_args {
 	size_t service_str_size;
 } g_mdns_args;
 
-static uint32_t service_address_ipv4;
-static uint8_t service_address_ipv6[16];
-
-static int has_ipv4;
-static int has_ipv6;
-
-uint16_t current_transaction_id;
 struct mdns_record current_mdns_record;
 
 pthread_t mdns_thread;
 
 #define MDNS_BUFFER_SIZE 2048
+#define MDNS_MAX_SOCKETS 32
+// queries start a second apart and back off to half the record TTL
+#define MDNS_QUERY_MIN_MS 1000
+#define MDNS_QUERY_LIMIT_MS (3600 * 1000)
+#define MDNS_POLL_MS 250
 
-static char addrbuffer[64];
 static char namebuffer[256];
 static char sendbuffer[256];
 static char entrybuffer[256];
 static mdns_record_txt_t txtbuffer[128];
 
-std::map<std::string, mdns_record> ssp_records;
-std::mutex ssp_records_lock;
+/* Readers get the published table, an immutable snapshot they hold on to
+ * for as long as they need it. Only the mDNS thread changes its working
+ * copy and publishes a new snapshot when it did. */
+static std::shared_ptr<const mdns_table> ssp_records =
+	std::make_shared<const mdns_table>();
+static mdns_table working_records;
+static bool working_changed;
+static uint64_t next_expiry = UINT64_MAX;
+static uint64_t query_max_ms = DEFAULT_TTL * 1000 / 2;
+// what listeners last heard of, device name to address
+static std::map<std::string, std::string> listed_devices;
+
+static std::mutex listeners_lock;
+static std::vector<std::pair<ssp_mdns_listener, void *>> listeners;
 
 static mdns_string_t ipv4_address_to_string(char *buffer, size_t capacity,
 					    const struct sockaddr_in *addr,
@@ -132,6 +154,40 @@ static mdns_string_t ip_address_to_string(char *buffer, size_t capacity,
 		buffer, capacity, (const struct sockaddr_in *)addr, addrlen);
 }
 
+// IPv4 preferred, empty while neither address is known
+static std::string record_address(const mdns_record &record)
+{
+	char addrbuffer[64];
+	mdns_string_t addr;
+	if (record.has_a)
+		addr = ipv4_address_to_string(addrbuffer, sizeof(addrbuffer),
+					      &record.a_record,
+					      sizeof(record.a_record));
+	else if (record.has_aaaa)
+		addr = ipv6_address_to_string(addrbuffer, sizeof(addrbuffer),
+					      &record.aaaa_record,
+					      sizeof(record.aaaa_record));
+	else
+		return std::string();
+	return std::string(addr.str, addr.length);
+}
+
+// a device is gone when the first of its records expires
+static void update_record(uint64_t expires, uint32_t ttl)
+{
+	auto &record = current_mdns_record;
+	if (ttl == 0) {
+		record.has_ptr = false;
+		if (working_records.erase(record.ptr_record))
+			working_changed = true;
+		return;
+	}
+	record.last_available = std::min(record.last_available, expires);
+	record.ttl = std::min(record.ttl, ttl);
+	working_records[record.ptr_record] = record;
+	working_changed = true;
+}
+
 static int query_callback(int sock, const struct sockaddr *from, size_t addrlen,
 			  mdns_entry_type_t entry, uint16_t transaction_id,
 			  uint16_t rtype, uint16_t rclass, uint32_t ttl,
@@ -139,22 +195,34 @@ static int query_callback(int sock, const struct sockaddr *from, size_t addrlen,
 			  size_t name_length, size_t record_offset,
 			  size_t record_length, void *user_data)
 {
-	if (transaction_id != current_transaction_id) {
-		current_mdns_record.has_ptr = false;
-		current_mdns_record.has_a = false;
-		current_mdns_record.has_aaaa = false;
-		current_transaction_id = transaction_id;
-	}
-	ttl = DEFAULT_TTL; // The mdns library we use cannot query all interface so we use a longer ttl.
+	uint64_t expires = os_gettime_ns() / 1000000 + (uint64_t)ttl * 1000;
 	if (rtype == MDNS_RECORDTYPE_PTR) {
+		// the socket hears every service announced on the network
+		size_t offset = name_offset;
+		mdns_string_t name = mdns_string_extract(
+			data, size, &offset, entrybuffer, sizeof(entrybuffer));
+		size_t domain_len = strlen(ZCAM_QUERY_DOMAIN);
+		if (name.length < domain_len ||
+		    strncmp(name.str, ZCAM_QUERY_DOMAIN, domain_len) != 0) {
+			return 0;
+		}
 		mdns_string_t ptr_str = mdns_record_parse_ptr(
 			data, size, record_offset, record_length, namebuffer,
 			sizeof(namebuffer));
-		std::string ptr(ptr_str.str,
-				ptr_str.length - strlen(ZCAM_QUERY_DOMAIN) - 2);
+		if (ptr_str.length < domain_len + 2) {
+			return 0;
+		}
+		std::string ptr(ptr_str.str, ptr_str.length - domain_len - 2);
+		if (ttl == 0) {
+			// goodbye, the camera is leaving
+			current_mdns_record.has_ptr = false;
+			if (working_records.erase(ptr))
+				working_changed = true;
+			return 0;
+		}
 		current_mdns_record.ptr_record = ptr;
-		current_mdns_record.last_available =
-			os_gettime_ns() / 1000000 + ttl * 1000;
+		current_mdns_record.last_available = expires;
+		current_mdns_record.ttl = ttl;
 		current_mdns_record.has_ptr = true;
 	} else if (current_mdns_record.has_ptr && rtype == MDNS_RECORDTYPE_A &&
 		   from->sa_family == AF_INET) {
@@ -164,12 +232,7 @@ static int query_callback(int sock, const struct sockaddr *from, size_t addrlen,
 		memcpy(&(current_mdns_record.a_record), &addr,
 		       sizeof(current_mdns_record.a_record));
 		current_mdns_record.has_a = true;
-		current_mdns_record.last_available =
-			os_gettime_ns() / 1000000 + ttl * 1000;
-		ssp_records_lock.lock();
-		ssp_records[current_mdns_record.ptr_record] =
-			current_mdns_record;
-		ssp_records_lock.unlock();
+		update_record(expires, ttl);
 	} else if (current_mdns_record.has_ptr &&
 		   rtype == MDNS_RECORDTYPE_AAAA &&
 		   from->sa_family == AF_INET6) {
@@ -179,21 +242,19 @@ static int query_callback(int sock, const struct sockaddr *from, size_t addrlen,
 		memcpy(&(current_mdns_record.aaaa_record), &addr,
 		       sizeof(current_mdns_record.aaaa_record));
 		current_mdns_record.has_aaaa = true;
-		current_mdns_record.last_available =
-			os_gettime_ns() / 1000000 + ttl * 1000;
-		ssp_records_lock.lock();
-		ssp_records[current_mdns_record.ptr_record] =
-			current_mdns_record;
-		ssp_records_lock.unlock();
+		update_record(expires, ttl);
 	}
 	return 0;
 }
 
-static int open_client_sockets(int *sockets, int max_sockets, int port)
+// the addresses of the interfaces that are up, loopback left out
+static void get_interface_addresses(std::vector<sockaddr_storage> &addresses)
 {
-	// When sending, each socket can only send to one network interface
-	// Thus we need to open one socket for each interface and address family
-	int num_sockets = 0;
+	static const unsigned char localhost[] = {0, 0, 0, 0, 0, 0, 0, 0,
+						  0, 0, 0, 0, 0, 0, 0, 1};
+	static const unsigned char localhost_mapped[] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0, 0, 1};
+	sockaddr_storage address;
 
 #ifdef _WIN32
 
@@ -218,11 +279,9 @@ static int open_client_sockets(int *sockets, int max_sockets, int port)
 	if (!adapter_address || (ret != NO_ERROR)) {
 		free(adapter_address);
 		ssp_blog(LOG_ERROR, "Failed to get network adapter addresses");
-		return num_sockets;
+		return;
 	}
 
-	int first_ipv4 = 1;
-	int first_ipv6 = 1;
 	for (PIP_ADAPTER_ADDRESSES adapter = adapter_address; adapter;
 	     adapter = adapter->Next) {
 		if (adapter->TunnelType == TUNNEL_TYPE_TEREDO)
@@ -241,82 +300,23 @@ static int open_client_sockets(int *sockets, int max_sockets, int port)
 				    (saddr->sin_addr.S_un.S_un_b.s_b2 != 0) ||
 				    (saddr->sin_addr.S_un.S_un_b.s_b3 != 0) ||
 				    (saddr->sin_addr.S_un.S_un_b.s_b4 != 1)) {
-					int log_addr = 0;
-					if (first_ipv4) {
-						service_address_ipv4 =
-							saddr->sin_addr.S_un
-								.S_addr;
-						first_ipv4 = 0;
-						log_addr = 1;
-					}
-					has_ipv4 = 1;
-					if (num_sockets < max_sockets) {
-						saddr->sin_port = htons(
-							(unsigned short)port);
-						int sock =
-							mdns_socket_open_ipv4(
-								saddr);
-						if (sock >= 0) {
-							sockets[num_sockets++] =
-								sock;
-							log_addr = 1;
-						} else {
-							log_addr = 0;
-						}
-					}
-					if (log_addr) {
-						char buffer[128];
-						mdns_string_t addr = ipv4_address_to_string(
-							buffer, sizeof(buffer),
-							saddr,
-							sizeof(struct sockaddr_in));
-					}
+					memset(&address, 0, sizeof(address));
+					memcpy(&address, saddr, sizeof(*saddr));
+					addresses.push_back(address);
 				}
 			} else if (unicast->Address.lpSockaddr->sa_family ==
 				   AF_INET6) {
 				struct sockaddr_in6 *saddr =
 					(struct sockaddr_in6 *)
 						unicast->Address.lpSockaddr;
-				static const unsigned char localhost[] = {
-					0, 0, 0, 0, 0, 0, 0, 0,
-					0, 0, 0, 0, 0, 0, 0, 1};
-				static const unsigned char localhost_mapped[] = {
-					0, 0, 0,    0,    0,    0, 0, 0,
-					0, 0, 0xff, 0xff, 0x7f, 0, 0, 1};
 				if ((unicast->DadState == NldsPreferred) &&
 				    memcmp(saddr->sin6_addr.s6_addr, localhost,
 					   16) &&
 				    memcmp(saddr->sin6_addr.s6_addr,
 					   localhost_mapped, 16)) {
-					int log_addr = 0;
-					if (first_ipv6) {
-						memcpy(service_address_ipv6,
-						       &saddr->sin6_addr, 16);
-						first_ipv6 = 0;
-						log_addr = 1;
-					}
-					has_ipv6 = 1;
-					if (num_sockets < max_sockets) {
-						saddr->sin6_port = htons(
-							(unsigned short)port);
-						int sock =
-							mdns_socket_open_ipv6(
-								saddr);
-						if (sock >= 0) {
-							sockets[num_sockets++] =
-								sock;
-							log_addr = 1;
-						} else {
-							log_addr = 0;
-						}
-					}
-					if (log_addr) {
-						char buffer[128];
-						mdns_string_t addr = ipv6_address_to_string(
-							buffer, sizeof(buffer),
-							saddr,
-							sizeof(struct sockaddr_in6));
-					}
+					memset(&address, 0, sizeof(address));
+					memcpy(&address, saddr, sizeof(*saddr));
+					addresses.push_back(address);
 				}
 			}
 		}
@@ -329,79 +329,32 @@ static int open_client_sockets(int *sockets, int max_sockets, int port)
 	struct ifaddrs *ifaddr = 0;
 	struct ifaddrs *ifa = 0;
 
-	if (getifaddrs(&ifaddr) < 0)
+	if (getifaddrs(&ifaddr) < 0) {
 		ssp_blog(LOG_ERROR, "Unable to get interface addresses");
+		return;
+	}
 
-	int first_ipv4 = 1;
-	int first_ipv6 = 1;
 	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
-		if (!ifa->ifa_addr)
+		if (!ifa->ifa_addr || !(ifa->ifa_flags & IFF_UP))
 			continue;
 
 		if (ifa->ifa_addr->sa_family == AF_INET) {
 			struct sockaddr_in *saddr =
 				(struct sockaddr_in *)ifa->ifa_addr;
 			if (saddr->sin_addr.s_addr != htonl(INADDR_LOOPBACK)) {
-				int log_addr = 0;
-				if (first_ipv4) {
-					service_address_ipv4 =
-						saddr->sin_addr.s_addr;
-					first_ipv4 = 0;
-					log_addr = 1;
-				}
-				has_ipv4 = 1;
-				if (num_sockets < max_sockets) {
-					saddr->sin_port = htons(port);
-					int sock = mdns_socket_open_ipv4(saddr);
-					if (sock >= 0) {
-						sockets[num_sockets++] = sock;
-						log_addr = 1;
-					} else {
-						log_addr = 0;
-					}
-				}
-				if (log_addr) {
-					char buffer[128];
-					mdns_string_t addr = ipv4_address_to_string(
-						buffer, sizeof(buffer), saddr,
-						sizeof(struct sockaddr_in));
-				}
+				memset(&address, 0, sizeof(address));
+				memcpy(&address, saddr, sizeof(*saddr));
+				addresses.push_back(address);
 			}
 		} else if (ifa->ifa_addr->sa_family == AF_INET6) {
 			struct sockaddr_in6 *saddr =
 				(struct sockaddr_in6 *)ifa->ifa_addr;
-			static const unsigned char localhost[] = {
-				0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
-			static const unsigned char localhost_mapped[] = {
-				0, 0, 0,    0,    0,    0, 0, 0,
-				0, 0, 0xff, 0xff, 0x7f, 0, 0, 1};
 			if (memcmp(saddr->sin6_addr.s6_addr, localhost, 16) &&
 			    memcmp(saddr->sin6_addr.s6_addr, localhost_mapped,
 				   16)) {
-				int log_addr = 0;
-				if (first_ipv6) {
-					memcpy(service_address_ipv6,
-					       &saddr->sin6_addr, 16);
-					first_ipv6 = 0;
-					log_addr = 1;
-				}
-				has_ipv6 = 1;
-				if (num_sockets < max_sockets) {
-					saddr->sin6_port = htons(port);
-					int sock = mdns_socket_open_ipv6(saddr);
-					if (sock >= 0) {
-						sockets[num_sockets++] = sock;
-						log_addr = 1;
-					} else {
-						log_addr = 0;
-					}
-				}
-				if (log_addr) {
-					char buffer[128];
-					mdns_string_t addr = ipv6_address_to_string(
-						buffer, sizeof(buffer), saddr,
-						sizeof(struct sockaddr_in6));
-				}
+				memset(&address, 0, sizeof(address));
+				memcpy(&address, saddr, sizeof(*saddr));
+				addresses.push_back(address);
 			}
 		}
 	}
@@ -409,93 +362,376 @@ static int open_client_sockets(int *sockets, int max_sockets, int port)
 	freeifaddrs(ifaddr);
 
 #endif
+}
 
-	return num_sockets;
+static bool same_address(const sockaddr_storage &a, const sockaddr_storage &b)
+{
+	if (a.ss_family != b.ss_family)
+		return false;
+	if (a.ss_family == AF_INET) {
+		auto a4 = (const struct sockaddr_in *)&a;
+		auto b4 = (const struct sockaddr_in *)&b;
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	}
+	auto a6 = (const struct sockaddr_in6 *)&a;
+	auto b6 = (const struct sockaddr_in6 *)&b;
+	return a6->sin6_scope_id == b6->sin6_scope_id &&
+	       memcmp(&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
 }
 
-static int send_mdns_query(const char *service, size_t service_len)
+static std::string address_string(const sockaddr_storage &address)
 {
-	static int current_id = 1;
-	int sockets[32];
-	int query_id[32];
-	int num_sockets = open_client_sockets(
-		sockets, sizeof(sockets) / sizeof(sockets[0]), 0);
-	if (num_sockets <= 0) {
-		ssp_blog(LOG_ERROR, "Failed to open any client sockets");
-		return -1;
+	char buffer[128];
+	mdns_string_t str = ip_address_to_string(
+		buffer, sizeof(buffer), (const struct sockaddr *)&address,
+		address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+					      : sizeof(struct sockaddr_in));
+	return std::string(str.str, str.length);
+}
+
+/* On the mDNS port, to hear answers and announcements alike. Where the port
+ * cannot be had the socket only gets the answers to its own queries. */
+static int open_interface_socket(const sockaddr_storage &address)
+{
+	sockaddr_storage saddr = address;
+	int ports[] = {MDNS_PORT, 0};
+	for (int port : ports) {
+		int sock;
+		if (saddr.ss_family == AF_INET) {
+			auto saddr4 = (struct sockaddr_in *)&saddr;
+			saddr4->sin_port = htons((unsigned short)port);
+			sock = mdns_socket_open_ipv4(saddr4);
+		} else {
+			auto saddr6 = (struct sockaddr_in6 *)&saddr;
+			saddr6->sin6_port = htons((unsigned short)port);
+			sock = mdns_socket_open_ipv6(saddr6);
+		}
+		if (sock >= 0)
+			return sock;
 	}
+	return -1;
+}
+
+/* Tells when interface addresses come and go: netlink on Linux, a routing
+ * socket on macOS, both selectable. On Windows a change notification sets
+ * a flag that the loop picks up on its next wake. */
+#ifdef _WIN32
+static std::atomic<bool> addresses_changed;
+static HANDLE address_notify;
+
+static void WINAPI address_change_callback(PVOID context,
+					   PMIB_UNICASTIPADDRESS_ROW row,
+					   MIB_NOTIFICATION_TYPE type)
+{
+	UNUSED_PARAMETER(context);
+	UNUSED_PARAMETER(row);
+	UNUSED_PARAMETER(type);
+	addresses_changed = true;
+}
+#endif
 
-	size_t capacity = 2048;
-	void *buffer = malloc(capacity);
-	void *user_data = 0;
-	size_t records;
-	for (int isock = 0; isock < num_sockets; ++isock) {
-		query_id[isock] = mdns_query_send(sockets[isock],
-						  MDNS_RECORDTYPE_PTR, service,
-						  service_len, buffer, capacity,
-						  current_id++);
-		if (query_id[isock] < 0)
-			ssp_blog(LOG_DEBUG, "Failed to send mDNS query: %s",
-				 strerror(errno));
+static int open_address_monitor()
+{
+#if defined(__linux__)
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_nl sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
 	}
+	return fd;
+#elif defined(__APPLE__)
+	return socket(PF_ROUTE, SOCK_RAW, AF_UNSPEC);
+#else
+	if (NotifyUnicastIpAddressChange(AF_UNSPEC, address_change_callback,
+					 nullptr, FALSE,
+					 &address_notify) != NO_ERROR)
+		address_notify = nullptr;
+	return -1;
+#endif
+}
 
-	// This is a simple implementation that loops for 5 seconds or as long as we get replies
-	int res;
-	do {
-		struct timeval timeout;
-		timeout.tv_sec = 2;
-		timeout.tv_usec = 0;
+static void close_address_monitor(int fd)
+{
+#ifdef _WIN32
+	UNUSED_PARAMETER(fd);
+	if (address_notify)
+		CancelMibChangeNotify2(address_notify);
+	address_notify = nullptr;
+#else
+	if (fd >= 0)
+		close(fd);
+#endif
+}
 
-		int nfds = 0;
-		fd_set readfs;
-		FD_ZERO(&readfs);
-		for (int isock = 0; isock < num_sockets; ++isock) {
-			if (sockets[isock] >= nfds)
-				nfds = sockets[isock] + 1;
-			FD_SET(sockets[isock], &readfs);
+// true when any address was added or removed
+static bool read_address_monitor(int fd)
+{
+	bool changed = false;
+#if defined(__linux__)
+	char buf[4096];
+	ssize_t len;
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for (struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+		     NLMSG_OK(nh, (size_t)len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == RTM_NEWADDR ||
+			    nh->nlmsg_type == RTM_DELADDR)
+				changed = true;
 		}
+	}
+#elif defined(__APPLE__)
+	char buf[2048];
+	ssize_t len;
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		auto rtm = (struct rt_msghdr *)buf;
+		if (rtm->rtm_type == RTM_NEWADDR ||
+		    rtm->rtm_type == RTM_DELADDR)
+			changed = true;
+	}
+#else
+	UNUSED_PARAMETER(fd);
+	changed = addresses_changed.exchange(false);
+#endif
+	return changed;
+}
 
-		records = 0;
-		res = select(nfds, &readfs, 0, 0, &timeout);
-		if (res > 0) {
-			for (int isock = 0; isock < num_sockets; ++isock) {
-				if (FD_ISSET(sockets[isock], &readfs)) {
-					records += mdns_query_recv(
-						sockets[isock], buffer,
-						capacity, query_callback,
-						user_data, query_id[isock]);
-				}
-				FD_SET(sockets[isock], &readfs);
-			}
+static void send_mdns_query(int sock, const mdns_args *arg, void *buffer)
+{
+	if (mdns_query_send(sock, MDNS_RECORDTYPE_PTR, arg->service_str,
+			    arg->service_str_size, buffer, MDNS_BUFFER_SIZE,
+			    0) < 0)
+		ssp_blog(LOG_DEBUG, "Failed to send mDNS query: %s",
+			 strerror(errno));
+}
+
+static void notify_listeners()
+{
+	std::lock_guard<std::mutex> locker(listeners_lock);
+	for (auto &listener : listeners)
+		listener.first(listener.second);
+}
+
+/* Expired records are dropped from what is published. Listeners hear of it
+ * when a device came, went or moved, not when its records were refreshed. */
+static void publish_records()
+{
+	uint64_t now = os_gettime_ns() / 1000000;
+	uint32_t min_ttl = DEFAULT_TTL;
+	bool first = true;
+	next_expiry = UINT64_MAX;
+	std::map<std::string, std::string> devices;
+	for (auto it = working_records.begin(); it != working_records.end();) {
+		if (it->second.last_available < now) {
+			it = working_records.erase(it);
+			continue;
 		}
-	} while (res > 0);
+		next_expiry = std::min(next_expiry, it->second.last_available);
+		min_ttl = first ? it->second.ttl
+				: std::min(min_ttl, it->second.ttl);
+		first = false;
+		devices[it->first] = record_address(it->second);
+		++it;
+	}
+	std::shared_ptr<const mdns_table> records =
+		std::make_shared<mdns_table>(working_records);
+	std::atomic_store(&ssp_records, records);
+	working_changed = false;
+
+	// refreshed at half the shortest TTL, well before anything expires
+	query_max_ms = std::max<uint64_t>(
+		MDNS_QUERY_MIN_MS,
+		std::min<uint64_t>((uint64_t)min_ttl * 1000 / 2,
+				   MDNS_QUERY_LIMIT_MS));
+
+	if (devices != listed_devices) {
+		listed_devices = std::move(devices);
+		ssp_blog(LOG_INFO, "mdns: %zu devices listed",
+			 listed_devices.size());
+		notify_listeners();
+	}
+}
 
-	free(buffer);
+struct mdns_socket {
+	int sock;
+	sockaddr_storage address;
+	uint64_t next_query;
+	uint64_t interval;
+};
 
-	for (int isock = 0; isock < num_sockets; ++isock)
-		mdns_socket_close(sockets[isock]);
+/* Sockets of addresses that went away are closed, new addresses get one
+ * that queries right away, the others are left alone. */
+static void sync_sockets(std::vector<mdns_socket> &sockets, uint64_t now)
+{
+	std::vector<sockaddr_storage> addresses;
+	get_interface_addresses(addresses);
+
+	for (auto it = sockets.begin(); it != sockets.end();) {
+		bool found = false;
+		for (auto &address : addresses) {
+			if (same_address(it->address, address)) {
+				found = true;
+				break;
+			}
+		}
+		if (found) {
+			++it;
+			continue;
+		}
+		ssp_blog(LOG_INFO, "mdns: %s went away",
+			 address_string(it->address).c_str());
+		mdns_socket_close(it->sock);
+		it = sockets.erase(it);
+	}
 
-	return 0;
+	for (auto &address : addresses) {
+		bool found = false;
+		for (auto &socket : sockets) {
+			if (same_address(socket.address, address)) {
+				found = true;
+				break;
+			}
+		}
+		if (found || sockets.size() >= MDNS_MAX_SOCKETS)
+			continue;
+		int sock = open_interface_socket(address);
+		if (sock < 0)
+			continue;
+		sockets.push_back({sock, address, now, MDNS_QUERY_MIN_MS});
+		ssp_blog(LOG_INFO, "mdns: browsing on %s",
+			 address_string(address).c_str());
+	}
 }
 
+/* The sockets stay open for the whole session, one per interface address,
+ * and follow the addresses as they change. Each one queries at growing
+ * intervals, RFC 6762 5.2, starting over when its address is new. A camera
+ * that appears in between is heard from its announcement. */
 static void *mdns_loop(void *ptr)
 {
 	mdns_args *arg = (mdns_args *)ptr;
 	void *buffer = bzalloc(MDNS_BUFFER_SIZE);
-	int sock = mdns_socket_open_ipv4(0);
+	std::vector<mdns_socket> sockets;
+	int monitor = open_address_monitor();
+	bool resync = true;
+	uint64_t queries = 0;
+	uint64_t packets = 0;
+
 	while (arg->running) {
-		send_mdns_query(arg->service_str, arg->service_str_size);
+		uint64_t now = os_gettime_ns() / 1000000;
+		if (resync) {
+			sync_sockets(sockets, now);
+			resync = false;
+		}
+
+		if (now >= next_expiry)
+			publish_records();
+
+		uint64_t next_query = now + query_max_ms;
+		for (auto &socket : sockets) {
+			if (now >= socket.next_query) {
+				send_mdns_query(socket.sock, arg, buffer);
+				queries++;
+				socket.next_query = now + socket.interval;
+				socket.interval = std::min<uint64_t>(
+					socket.interval * 2, query_max_ms);
+			}
+			next_query = std::min(next_query, socket.next_query);
+		}
+
+		// short enough for stop_mdns_loop to be answered in time
+		uint64_t wait = std::min<uint64_t>(next_query - now,
+						   MDNS_POLL_MS);
+		struct timeval timeout;
+		timeout.tv_sec = (long)(wait / 1000);
+		timeout.tv_usec = (long)(wait % 1000) * 1000;
+
+		int nfds = 0;
+		fd_set readfs;
+		FD_ZERO(&readfs);
+		for (auto &socket : sockets) {
+			if (socket.sock >= nfds)
+				nfds = socket.sock + 1;
+			FD_SET(socket.sock, &readfs);
+		}
+		if (monitor >= 0) {
+			if (monitor >= nfds)
+				nfds = monitor + 1;
+			FD_SET(monitor, &readfs);
+		}
+		int res = 0;
+		if (nfds == 0) {
+			os_sleep_ms((uint32_t)wait);
+		} else {
+			res = select(nfds, &readfs, 0, 0, &timeout);
+		}
+#ifdef _WIN32
+		resync = read_address_monitor(monitor);
+#else
+		if (monitor < 0) {
+			// nothing tells us, look again with the next query
+			resync = os_gettime_ns() / 1000000 >= next_query;
+		} else if (res > 0 && FD_ISSET(monitor, &readfs)) {
+			resync = read_address_monitor(monitor);
+		}
+#endif
+		if (res <= 0)
+			continue;
+		for (auto &socket : sockets) {
+			if (!FD_ISSET(socket.sock, &readfs))
+				continue;
+			// a datagram is one response, its records go together
+			current_mdns_record.has_ptr = false;
+			current_mdns_record.has_a = false;
+			current_mdns_record.has_aaaa = false;
+			mdns_query_recv(socket.sock, buffer, MDNS_BUFFER_SIZE,
+					query_callback, nullptr, 0);
+			packets++;
+		}
+		if (working_changed)
+			publish_records();
 	}
-	mdns_socket_close(sock);
+
+	for (auto &socket : sockets)
+		mdns_socket_close(socket.sock);
+	close_address_monitor(monitor);
 	bfree(buffer);
+	ssp_blog(LOG_INFO, "mdns: %llu queries sent, %llu packets received",
+		 (unsigned long long)queries, (unsigned long long)packets);
 	return nullptr;
 }
 
+void ssp_mdns_add_listener(ssp_mdns_listener callback, void *data)
+{
+	std::lock_guard<std::mutex> locker(listeners_lock);
+	listeners.emplace_back(callback, data);
+}
+
+void ssp_mdns_remove_listener(ssp_mdns_listener callback, void *data)
+{
+	std::lock_guard<std::mutex> locker(listeners_lock);
+	listeners.erase(std::remove(listeners.begin(), listeners.end(),
+				    std::make_pair(callback, data)),
+			listeners.end());
+}
+
+static void clear_records()
+{
+	working_records.clear();
+	working_changed = false;
+	next_expiry = UINT64_MAX;
+	query_max_ms = DEFAULT_TTL * 1000 / 2;
+	listed_devices.clear();
+	std::atomic_store(&ssp_records, std::make_shared<const mdns_table>());
+}
+
 void create_mdns_loop()
 {
-	ssp_records_lock.lock();
-	ssp_records.clear();
-	ssp_records_lock.unlock();
+	clear_records();
 	g_mdns_args.service_str = ZCAM_QUERY_DOMAIN;
 	g_mdns_args.service_str_size = strlen(ZCAM_QUERY_DOMAIN);
 	g_mdns_args.running = true;
@@ -505,59 +741,37 @@ void create_mdns_loop()
 
 void stop_mdns_loop()
 {
-	ssp_records_lock.lock();
-	ssp_records.clear();
-	ssp_records_lock.unlock();
 	ssp_blog(LOG_INFO, "stop mdns query thread...");
 	while (g_mdns_args.running)
 		g_mdns_args.running = false;
 	pthread_join(mdns_thread, nullptr);
+	clear_records();
 	ssp_blog(LOG_INFO, "mdns query thread stopped.");
 }
 
 SspMDnsIterator::SspMDnsIterator()
 {
-	ssp_records_lock.lock();
-	iter = ssp_records.begin();
+	records = std::atomic_load(&ssp_records);
+	iter = records->begin();
 	current_time = os_gettime_ns() / 1000000;
 }
-SspMDnsIterator::~SspMDnsIterator()
-{
-	ssp_records_lock.unlock();
-}
+SspMDnsIterator::~SspMDnsIterator() {}
 bool SspMDnsIterator::hasNext()
 {
-	return iter != ssp_records.end();
+	return iter != records->end();
 }
 ssp_device_item *SspMDnsIterator::next()
 {
-	static ssp_device_item ret;
 	while (hasNext()) {
 		if (iter->second.last_available < current_time) {
 			++iter;
 			continue;
 		}
-		ret.device_name = iter->second.ptr_record;
-		if (iter->second.has_a) {
-			mdns_string_t addr = ipv4_address_to_string(
-				addrbuffer, sizeof(addrbuffer),
-				&(iter->second.a_record),
-				sizeof(iter->second.a_record));
-			ret.ip_address = std::string(addr.str, addr.length);
-			++iter;
-			return &ret;
-		} else if (iter->second.has_aaaa) {
-			mdns_string_t addr = ipv6_address_to_string(
-				addrbuffer, sizeof(addrbuffer),
-				&(iter->second.aaaa_record),
-				sizeof(iter->second.aaaa_record));
-			ret.ip_address = std::string(addr.str, addr.length);
-			++iter;
-			return &ret;
-		} else {
-			++iter;
-			continue;
-		}
+		item.device_name = iter->second.ptr_record;
+		item.ip_address = record_address(iter->second);
+		++iter;
+		if (!item.ip_address.empty())
+			return &item;
 	}
 	return nullptr;
 }
@@ -22,6 +22,7 @@ along with this program; If not, see <https://www.gnu.org/licenses/>
 
 #include <string>
 #include <map>
+#include <memory>
 
 struct ssp_device_item {
 	std::string device_name;
@@ -36,8 +37,15 @@ struct mdns_record {
 	bool has_aaaa;
 	sockaddr_in6 aaaa_record;
 	uint64_t last_available;
+	// the shortest of its records, in seconds
+	uint32_t ttl;
 };
 
+typedef std::map<std::string, mdns_record> mdns_table;
+
+/* Walks a snapshot of the discovered devices, taken when it is created and
+ * not changed by discovery going on meanwhile. next() returns an item owned
+ * by the iterator, valid until the following call. */
 class SspMDnsIterator {
 public:
 	SspMDnsIterator();
@@ -47,9 +55,17 @@ public:
 
 private:
 	uint64_t current_time;
-	std::map<std::string, mdns_record>::const_iterator iter;
+	std::shared_ptr<const mdns_table> records;
+	mdns_table::const_iterator iter;
+	ssp_device_item item;
 };
 
+/* Called on the discovery thread when the list of devices changed, a device
+ * came, went or has a new address. It must not block. */
+typedef void (*ssp_mdns_listener)(void *data);
+void ssp_mdns_add_listener(ssp_mdns_listener callback, void *data);
+void ssp_mdns_remove_listener(ssp_mdns_listener callback, void *data);
+
 void create_mdns_loop();
 void stop_mdns_loop();
 #endif //OBS_SSP_SSP_MDNS_H
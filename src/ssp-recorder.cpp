@@ -0,0 +1,426 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <string.h>
+#include <obs.h>
+#include <util/platform.h>
+
+#include <ssp_connector_nal.h>
+
+#include "obs-ssp.h"
+#include "ssp-recorder.h"
+
+// SSP timestamps are in microseconds
+static const AVRational ssp_time_base = {1, 1000000};
+
+static const uint32_t aac_sample_rates[] = {96000, 88200, 64000, 48000, 44100,
+					    32000, 24000, 22050, 16000, 12000,
+					    11025, 8000,  7350};
+
+static bool set_extradata(AVCodecParameters *par, const uint8_t *data,
+			  size_t size)
+{
+	par->extradata =
+		(uint8_t *)av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (!par->extradata) {
+		return false;
+	}
+	memcpy(par->extradata, data, size);
+	par->extradata_size = (int)size;
+	return true;
+}
+
+/* The parameter sets of a keyframe as Annex B, the muxers turn them into
+ * avcC/hvcC themselves. */
+static bool set_video_extradata(AVCodecParameters *par, VideoData *video)
+{
+	static const uint8_t startcode[4] = {0, 0, 0, 1};
+	uint8_t extradata[4096];
+	size_t size = 0;
+	bool hevc = par->codec_id == AV_CODEC_ID_HEVC;
+
+	for (int i = 0; i < video->nal.count; i++) {
+		auto &unit = video->nal.units[i];
+		bool paramset = hevc ? unit.type >= 32 && unit.type <= 34
+				     : unit.type == 7 || unit.type == 8;
+		if (!paramset) {
+			continue;
+		}
+		const uint8_t *p = video->data + unit.offset;
+		const uint8_t *end = i + 1 < video->nal.count
+					     ? video->data +
+						       video->nal.units[i + 1]
+							       .offset -
+						       3
+					     : video->data + video->len;
+		while (end > p && end[-1] == 0) {
+			--end;
+		}
+		if (size + sizeof(startcode) + (end - p) > sizeof(extradata)) {
+			return false;
+		}
+		memcpy(extradata + size, startcode, sizeof(startcode));
+		size += sizeof(startcode);
+		memcpy(extradata + size, p, end - p);
+		size += end - p;
+	}
+	return size && set_extradata(par, extradata, size);
+}
+
+// AudioSpecificConfig of AAC-LC
+static bool set_audio_extradata(AVCodecParameters *par, uint32_t sampleRate,
+				uint32_t channels)
+{
+	int index = 4;
+	for (int i = 0; i < (int)(sizeof(aac_sample_rates) /
+				  sizeof(aac_sample_rates[0]));
+	     i++) {
+		if (aac_sample_rates[i] == sampleRate) {
+			index = i;
+			break;
+		}
+	}
+	uint8_t asc[2];
+	asc[0] = (uint8_t)((2 << 3) | (index >> 1));
+	asc[1] = (uint8_t)(((index & 1) << 7) | ((channels & 0xf) << 3));
+	return set_extradata(par, asc, sizeof(asc));
+}
+
+SSPRecorder::SSPRecorder(const std::string &pathPrefix, bool matroska,
+			 bool video)
+{
+	this->pathPrefix = pathPrefix;
+	this->matroska = matroska;
+	this->hasVideo = video;
+	this->stopping = false;
+	this->dropped = 0;
+	this->vcodec = AV_CODEC_ID_NONE;
+	this->width = 0;
+	this->height = 0;
+	this->acodec = AV_CODEC_ID_NONE;
+	this->sampleRate = 0;
+	this->channels = 0;
+	this->ctx = nullptr;
+	this->vstream = nullptr;
+	this->astream = nullptr;
+	this->packet = av_packet_alloc();
+	this->file = nullptr;
+	this->psHash = 0;
+	this->base = 0;
+	this->lastVideoTs = -1;
+	this->lastAudioTs = -1;
+	this->written = 0;
+	this->writer = std::thread(&SSPRecorder::WriterLoop, this);
+}
+
+SSPRecorder::~SSPRecorder()
+{
+	{
+		std::lock_guard<std::mutex> locker(lock);
+		stopping = true;
+		cond.notify_all();
+	}
+	writer.join();
+	av_packet_free(&packet);
+	if (dropped) {
+		ssp_blog(LOG_WARNING,
+			 "iso recording dropped %llu packets, disk too slow",
+			 (unsigned long long)dropped);
+	}
+}
+
+void SSPRecorder::setVideoMeta(AVCodecID codec, uint32_t width,
+			       uint32_t height)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	this->vcodec = codec;
+	this->width = width;
+	this->height = height;
+}
+
+void SSPRecorder::setAudioMeta(AVCodecID codec, uint32_t sampleRate,
+			       uint32_t channels)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	this->acodec = codec;
+	this->sampleRate = sampleRate;
+	this->channels = channels;
+}
+
+void SSPRecorder::push(SSPBuffer *buffer, bool wait)
+{
+	std::unique_lock<std::mutex> locker(lock);
+	if (wait) {
+		cond.wait(locker, [this]() {
+			return queue.size() < SSP_RECORDER_QUEUE_MAX;
+		});
+	} else if (queue.size() >= SSP_RECORDER_QUEUE_MAX) {
+		dropped++;
+		return;
+	}
+	buffer->addRef();
+	queue.push_back(buffer);
+	cond.notify_all();
+}
+
+void SSPRecorder::WriterLoop()
+{
+	for (;;) {
+		SSPBuffer *buffer;
+		{
+			std::unique_lock<std::mutex> locker(lock);
+			cond.wait(locker, [this]() {
+				return stopping || !queue.empty();
+			});
+			// what was received before the stop still goes out
+			if (queue.empty()) {
+				break;
+			}
+			buffer = queue.front();
+			queue.pop_front();
+			if (queue.size() == SSP_RECORDER_QUEUE_MAX - 1) {
+				cond.notify_all();
+			}
+		}
+		auto msg = (Message *)buffer->data;
+		if (msg->type == VideoDataMsg) {
+			WriteVideo((VideoData *)msg->value);
+		} else if (msg->type == AudioDataMsg) {
+			WriteAudio((AudioData *)msg->value);
+		}
+		buffer->release();
+	}
+	Close();
+}
+
+int SSPRecorder::WriteFile(void *opaque, uint8_t *buf, int size)
+{
+	auto self = (SSPRecorder *)opaque;
+	if (fwrite(buf, 1, size, self->file) != (size_t)size) {
+		return AVERROR(EIO);
+	}
+	self->written += size;
+	return size;
+}
+
+bool SSPRecorder::Open(VideoData *keyframe)
+{
+	AVCodecID vcodec, acodec;
+	uint32_t width, height, sampleRate, channels;
+	{
+		std::lock_guard<std::mutex> locker(lock);
+		vcodec = this->vcodec;
+		width = this->width;
+		height = this->height;
+		acodec = this->acodec;
+		sampleRate = this->sampleRate;
+		channels = this->channels;
+	}
+	if (keyframe && vcodec == AV_CODEC_ID_NONE) {
+		return false;
+	}
+
+	const char *ext = matroska ? "mkv" : "mp4";
+	char *name = os_generate_formatted_filename(
+		ext, true, "%CCYY-%MM-%DD %hh-%mm-%ss");
+	std::string path = pathPrefix + " " + name;
+	bfree(name);
+
+	if (avformat_alloc_output_context2(&ctx, nullptr,
+					   matroska ? "matroska" : "mp4",
+					   path.c_str()) < 0) {
+		ssp_blog(LOG_WARNING, "iso recording: no muxer for %s", ext);
+		ctx = nullptr;
+		return false;
+	}
+
+	if (keyframe) {
+		vstream = avformat_new_stream(ctx, nullptr);
+		auto par = vstream->codecpar;
+		par->codec_type = AVMEDIA_TYPE_VIDEO;
+		par->codec_id = vcodec;
+		par->width = width;
+		par->height = height;
+		vstream->time_base = ssp_time_base;
+		if (!set_video_extradata(par, keyframe)) {
+			ssp_blog(LOG_WARNING,
+				 "iso recording: bad parameter sets");
+			Close();
+			return false;
+		}
+	}
+	if (acodec == AV_CODEC_ID_AAC && sampleRate && channels) {
+		astream = avformat_new_stream(ctx, nullptr);
+		auto par = astream->codecpar;
+		par->codec_type = AVMEDIA_TYPE_AUDIO;
+		par->codec_id = AV_CODEC_ID_AAC;
+		par->sample_rate = sampleRate;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+		av_channel_layout_default(&par->ch_layout, channels);
+#else
+		par->channels = channels;
+		par->channel_layout = av_get_default_channel_layout(channels);
+#endif
+		astream->time_base = ssp_time_base;
+		set_audio_extradata(par, sampleRate, channels);
+	}
+
+	file = os_fopen(path.c_str(), "wb");
+	if (!file) {
+		ssp_blog(LOG_WARNING, "iso recording: cannot create %s",
+			 path.c_str());
+		Close();
+		return false;
+	}
+	// avio gathers the writes, each flush goes to disk in one call
+	setvbuf(file, nullptr, _IONBF, 0);
+	auto iobuf = (uint8_t *)av_malloc(SSP_RECORDER_IO_BUFFER);
+	ctx->pb = avio_alloc_context(iobuf, SSP_RECORDER_IO_BUFFER, 1, this,
+				     nullptr, WriteFile, nullptr);
+	if (!ctx->pb) {
+		av_free(iobuf);
+		Close();
+		return false;
+	}
+	ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	// fragments need no seeking back, and a crash loses one at most
+	AVDictionary *opts = nullptr;
+	if (!matroska) {
+		av_dict_set(&opts, "movflags",
+			    "frag_keyframe+empty_moov+default_base_moof", 0);
+	}
+	int ret = avformat_write_header(ctx, &opts);
+	av_dict_free(&opts);
+	if (ret < 0) {
+		ssp_blog(LOG_WARNING, "iso recording: cannot write header");
+		Close();
+		return false;
+	}
+
+	base = keyframe ? (int64_t)keyframe->pts : -1;
+	psHash = keyframe ? keyframe->nal.ps_hash : 0;
+	lastVideoTs = -1;
+	lastAudioTs = -1;
+	written = 0;
+	ssp_blog(LOG_INFO, "iso recording to %s", path.c_str());
+	return true;
+}
+
+void SSPRecorder::Close()
+{
+	if (!ctx) {
+		return;
+	}
+	if (ctx->pb && file) {
+		av_write_trailer(ctx);
+		avio_flush(ctx->pb);
+		ssp_blog(LOG_INFO, "iso recording closed, %llu bytes",
+			 (unsigned long long)written);
+	}
+	if (ctx->pb) {
+		av_freep(&ctx->pb->buffer);
+		avio_context_free(&ctx->pb);
+	}
+	avformat_free_context(ctx);
+	ctx = nullptr;
+	vstream = nullptr;
+	astream = nullptr;
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+}
+
+bool SSPRecorder::WritePacket(AVStream *stream, uint8_t *data, size_t size,
+			      int64_t ts, bool keyframe)
+{
+	packet->data = data;
+	packet->size = (int)size;
+	packet->pts = ts;
+	packet->dts = ts;
+	packet->stream_index = stream->index;
+	packet->flags = keyframe ? AV_PKT_FLAG_KEY : 0;
+	av_packet_rescale_ts(packet, ssp_time_base, stream->time_base);
+	int ret = av_interleaved_write_frame(ctx, packet);
+	av_packet_unref(packet);
+	if (ret < 0) {
+		ssp_blog(LOG_WARNING, "iso recording: write failed, stopping");
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void SSPRecorder::WriteVideo(VideoData *video)
+{
+	if (!hasVideo) {
+		return;
+	}
+	bool keyframe = video->flags & SSP_NAL_FLAG_KEYFRAME;
+	bool paramset = video->flags & SSP_NAL_FLAG_PARAMSET;
+	if (ctx && paramset && video->nal.ps_hash != psHash) {
+		ssp_blog(LOG_INFO, "iso recording: stream changed, new file");
+		Close();
+	}
+	if (!ctx) {
+		// a file starts with its parameter sets and an IDR
+		if (!keyframe || !paramset || !Open(video)) {
+			return;
+		}
+	}
+
+	int64_t ts = (int64_t)video->pts - base;
+	if (ts <= lastVideoTs) {
+		ts = lastVideoTs + 1;
+	}
+	lastVideoTs = ts;
+	WritePacket(vstream, video->data, video->len, ts, keyframe);
+}
+
+void SSPRecorder::WriteAudio(AudioData *audio)
+{
+	if (!ctx && !hasVideo && !Open(nullptr)) {
+		return;
+	}
+	if (!ctx || !astream) {
+		return;
+	}
+	if (base < 0) {
+		base = (int64_t)audio->pts;
+	}
+
+	uint8_t *data = audio->data;
+	size_t size = audio->len;
+	// the file carries raw AAC, strip ADTS headers
+	if (size > 9 && data[0] == 0xff && (data[1] & 0xf0) == 0xf0) {
+		size_t header = (data[1] & 0x01) ? 7 : 9;
+		data += header;
+		size -= header;
+	}
+
+	int64_t ts = (int64_t)audio->pts - base;
+	if (ts < 0) {
+		return;
+	}
+	if (ts <= lastAudioTs) {
+		ts = lastAudioTs + 1;
+	}
+	lastAudioTs = ts;
+	WritePacket(astream, data, size, ts, true);
+}
@@ -0,0 +1,99 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_RECORDER_H
+#define OBS_SSP_SSP_RECORDER_H
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+#include <ssp_connector_proto.h>
+#include "ssp-buffer-pool.h"
+
+// file writes are gathered into blocks of this size
+#define SSP_RECORDER_IO_BUFFER (1 << 20)
+// packets waiting for the writer before new ones are dropped
+#define SSP_RECORDER_QUEUE_MAX 1024
+
+/* Records a camera as it is received, H.264/HEVC and AAC without decoding,
+ * to a fragmented MP4 or a Matroska file. Packets are queued by reference
+ * on the receive side and muxed on a writer thread of its own, so a slow
+ * disk never holds up receiving or decoding. A file starts at a keyframe
+ * carrying parameter sets, when they change a new file is started. */
+class SSPRecorder {
+public:
+	SSPRecorder(const std::string &pathPrefix, bool matroska, bool video);
+	~SSPRecorder();
+
+	void setVideoMeta(AVCodecID codec, uint32_t width, uint32_t height);
+	void setAudioMeta(AVCodecID codec, uint32_t sampleRate,
+			  uint32_t channels);
+
+	/* The buffer holds the message of the record, it is referenced. When
+	 * the writer is behind it is dropped, or waited for with wait. */
+	void push(SSPBuffer *buffer, bool wait = false);
+
+private:
+	void WriterLoop();
+	bool Open(VideoData *keyframe);
+	void Close();
+	void WriteVideo(VideoData *video);
+	void WriteAudio(AudioData *audio);
+	bool WritePacket(AVStream *stream, uint8_t *data, size_t size,
+			 int64_t ts, bool keyframe);
+	static int WriteFile(void *opaque, uint8_t *buf, int size);
+
+	std::string pathPrefix;
+	bool matroska;
+	bool hasVideo;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<SSPBuffer *> queue;
+	bool stopping;
+	uint64_t dropped;
+	AVCodecID vcodec;
+	uint32_t width;
+	uint32_t height;
+	AVCodecID acodec;
+	uint32_t sampleRate;
+	uint32_t channels;
+
+	// writer thread only
+	AVFormatContext *ctx;
+	AVStream *vstream;
+	AVStream *astream;
+	AVPacket *packet;
+	FILE *file;
+	uint32_t psHash;
+	int64_t base;
+	int64_t lastVideoTs;
+	int64_t lastAudioTs;
+	uint64_t written;
+
+	std::thread writer;
+};
+
+#endif //OBS_SSP_SSP_RECORDER_H
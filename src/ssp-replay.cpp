@@ -0,0 +1,208 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <obs.h>
+
+#include <ssp_connector_nal.h>
+
+#include "obs-ssp.h"
+#include "ssp-recorder.h"
+#include "ssp-replay.h"
+
+static std::mutex saves_lock;
+static std::condition_variable saves_cond;
+static int saves_running;
+
+SSPReplayBuffer::SSPReplayBuffer()
+{
+	this->duration = 0;
+	this->audioOnly = false;
+	this->headSeq = 0;
+	this->bytes = 0;
+	this->psHash = 0;
+	this->vcodec = AV_CODEC_ID_NONE;
+	this->width = 0;
+	this->height = 0;
+	this->acodec = AV_CODEC_ID_NONE;
+	this->sampleRate = 0;
+	this->channels = 0;
+}
+
+SSPReplayBuffer::~SSPReplayBuffer()
+{
+	std::lock_guard<std::mutex> locker(lock);
+	Clear();
+}
+
+void SSPReplayBuffer::setDuration(uint32_t seconds)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	duration = (uint64_t)seconds * 1000000;
+	if (!duration) {
+		Clear();
+	}
+}
+
+void SSPReplayBuffer::setAudioOnly(bool enable)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	if (audioOnly != enable) {
+		Clear();
+		audioOnly = enable;
+	}
+}
+
+void SSPReplayBuffer::setVideoMeta(AVCodecID codec, uint32_t width,
+				   uint32_t height)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	this->vcodec = codec;
+	this->width = width;
+	this->height = height;
+}
+
+void SSPReplayBuffer::setAudioMeta(AVCodecID codec, uint32_t sampleRate,
+				   uint32_t channels)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	this->acodec = codec;
+	this->sampleRate = sampleRate;
+	this->channels = channels;
+}
+
+void SSPReplayBuffer::Clear()
+{
+	for (auto &entry : entries) {
+		entry.buffer->release();
+	}
+	entries.clear();
+	keyframes.clear();
+	headSeq = 0;
+	bytes = 0;
+	psHash = 0;
+}
+
+void SSPReplayBuffer::push(SSPBuffer *buffer)
+{
+	auto msg = (Message *)buffer->data;
+	uint64_t pts;
+	bool keyframe = false;
+
+	std::lock_guard<std::mutex> locker(lock);
+	if (!duration) {
+		return;
+	}
+	if (msg->type == VideoDataMsg) {
+		auto video = (VideoData *)msg->value;
+		pts = video->pts;
+		keyframe = video->flags & SSP_NAL_FLAG_KEYFRAME;
+		if (keyframe && (video->flags & SSP_NAL_FLAG_PARAMSET)) {
+			// a replay never spans a change of stream
+			if (psHash && psHash != video->nal.ps_hash) {
+				Clear();
+			}
+			psHash = video->nal.ps_hash;
+		}
+	} else if (msg->type == AudioDataMsg) {
+		pts = ((AudioData *)msg->value)->pts;
+		keyframe = audioOnly;
+	} else {
+		return;
+	}
+	if (entries.empty() && !keyframe) {
+		return;
+	}
+	if (keyframe) {
+		keyframes.push_back(headSeq + entries.size());
+	}
+	// held for the whole replay length, so it must not pin the shm ring
+	buffer = SSPBufferPool::global()->keep(buffer);
+	entries.push_back({buffer, pts});
+	bytes += buffer->size;
+	Trim(pts);
+}
+
+// drop whole GOPs from the front while the rest still covers the duration
+void SSPReplayBuffer::Trim(uint64_t now)
+{
+	while (keyframes.size() > 1) {
+		uint64_t next = keyframes[1];
+		auto &start = entries[next - headSeq];
+		if (now - start.pts < duration &&
+		    bytes <= SSP_REPLAY_MAX_BYTES) {
+			break;
+		}
+		while (headSeq < next) {
+			auto &entry = entries.front();
+			bytes -= entry.buffer->size;
+			entry.buffer->release();
+			entries.pop_front();
+			headSeq++;
+		}
+		keyframes.pop_front();
+	}
+}
+
+bool SSPReplayBuffer::save(const std::string &pathPrefix, bool matroska)
+{
+	std::vector<SSPBuffer *> buffers;
+	SSPRecorder *recorder;
+	{
+		std::lock_guard<std::mutex> locker(lock);
+		if (entries.empty()) {
+			return false;
+		}
+		// an audio-only recorder opens its file on the first audio
+		recorder = new SSPRecorder(pathPrefix, matroska, !audioOnly);
+		recorder->setVideoMeta(vcodec, width, height);
+		recorder->setAudioMeta(acodec, sampleRate, channels);
+		buffers.reserve(entries.size());
+		for (auto &entry : entries) {
+			entry.buffer->addRef();
+			buffers.push_back(entry.buffer);
+		}
+	}
+	ssp_blog(LOG_INFO, "saving replay of %zu packets", buffers.size());
+
+	// writing takes a while, receiving goes on meanwhile
+	{
+		std::lock_guard<std::mutex> locker(saves_lock);
+		saves_running++;
+	}
+	std::thread([recorder, buffers]() {
+		for (auto buffer : buffers) {
+			recorder->push(buffer, true);
+			buffer->release();
+		}
+		delete recorder;
+
+		std::lock_guard<std::mutex> locker(saves_lock);
+		saves_running--;
+		saves_cond.notify_all();
+	}).detach();
+	return true;
+}
+
+void SSPReplayBuffer::WaitForSaves()
+{
+	std::unique_lock<std::mutex> locker(saves_lock);
+	saves_cond.wait(locker, []() { return saves_running == 0; });
+}
@@ -0,0 +1,84 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_REPLAY_H
+#define OBS_SSP_SSP_REPLAY_H
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <string>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#include "ssp-buffer-pool.h"
+
+// held whatever the duration, a 4K stream at 150 Mbit/s for about 30 s
+#define SSP_REPLAY_MAX_BYTES ((size_t)512 << 20)
+
+/* The last seconds of a camera as received, compressed, in the pooled
+ * buffers the messages arrived in. It always starts at an IDR and is cut
+ * a GOP at a time, without video any audio frame will do. save() writes it
+ * out with an SSPRecorder on a thread of its own. */
+class SSPReplayBuffer {
+public:
+	SSPReplayBuffer();
+	~SSPReplayBuffer();
+
+	// 0 turns the buffer off and frees what it holds
+	void setDuration(uint32_t seconds);
+	// the stream carries no video, audio alone is kept
+	void setAudioOnly(bool enable);
+	void setVideoMeta(AVCodecID codec, uint32_t width, uint32_t height);
+	void setAudioMeta(AVCodecID codec, uint32_t sampleRate,
+			  uint32_t channels);
+
+	void push(SSPBuffer *buffer);
+	bool save(const std::string &pathPrefix, bool matroska);
+
+	// saves run detached, the module must not go away under them
+	static void WaitForSaves();
+
+private:
+	struct Entry {
+		SSPBuffer *buffer;
+		uint64_t pts;
+	};
+
+	void Clear();
+	void Trim(uint64_t now);
+
+	std::mutex lock;
+	uint64_t duration;
+	bool audioOnly;
+	std::deque<Entry> entries;
+	// sequence numbers of the entries that start a GOP
+	std::deque<uint64_t> keyframes;
+	uint64_t headSeq;
+	size_t bytes;
+	uint32_t psHash;
+
+	AVCodecID vcodec;
+	uint32_t width;
+	uint32_t height;
+	AVCodecID acodec;
+	uint32_t sampleRate;
+	uint32_t channels;
+};
+
+#endif //OBS_SSP_SSP_REPLAY_H
@@ -0,0 +1,126 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "ssp-shm-ring.h"
+
+SSPShmRing *SSPShmRing::Create(size_t size)
+{
+#ifdef __linux__
+	int fd = memfd_create("ssp-ring", MFD_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+	if (ftruncate(fd, (off_t)size) < 0) {
+		close(fd);
+		return nullptr;
+	}
+	void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return nullptr;
+	}
+	auto header = (ShmRingHeader *)map;
+	if (!shm_ring_init(header, size)) {
+		munmap(map, size);
+		close(fd);
+		return nullptr;
+	}
+	return new SSPShmRing(header, size, fd);
+#else
+	(void)size;
+	return nullptr;
+#endif
+}
+
+SSPShmRing::SSPShmRing(ShmRingHeader *header, size_t size, int fd)
+	: header(header), mapSize(size), mapFd(fd), refs(1), tail(0)
+{
+}
+
+SSPShmRing::~SSPShmRing()
+{
+#ifdef __linux__
+	munmap((void *)header, mapSize);
+	close(mapFd);
+#endif
+}
+
+void SSPShmRing::release()
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete this;
+	}
+}
+
+/* Doorbells arrive in ring order, a record going backwards or pointing at
+ * something not committed yet is a protocol error. */
+SSPBuffer *SSPShmRing::Wrap(const ShmDataRef *ref)
+{
+	auto msg = shm_ring_peek(header, ref);
+	if (!msg) {
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> locker(lock);
+	if (ref->pos < tail) {
+		return nullptr;
+	}
+	records.emplace_back();
+	auto &slot = records.back();
+	slot.pool = nullptr;
+	slot.refs.store(1, std::memory_order_relaxed);
+	slot.sizeClass = SSP_POOL_CLASSES;
+	slot.capacity = ref->length + SSP_SHM_PADDING;
+	slot.size = sizeof(Message) + msg->length;
+	slot.data = (uint8_t *)msg;
+	slot.dispose = Dispose;
+	slot.opaque = this;
+	slot.end = ref->pos + shm_ring_record(ref->length);
+	slot.done = false;
+	tail = slot.end;
+	addRef();
+	return &slot;
+}
+
+void SSPShmRing::Dispose(SSPBuffer *buf)
+{
+	auto ring = (SSPShmRing *)buf->opaque;
+	ring->Done(static_cast<Slot *>(buf));
+	ring->release();
+}
+
+void SSPShmRing::Done(Slot *slot)
+{
+	std::lock_guard<std::mutex> locker(lock);
+	slot->done = true;
+	if (!records.front().done) {
+		return;
+	}
+	uint64_t end = 0;
+	while (!records.empty() && records.front().done) {
+		end = records.front().end;
+		records.pop_front();
+	}
+	shm_ring_release(header, end);
+}
@@ -0,0 +1,69 @@
+/*
+obs-ssp
+ Copyright (C) 2019-2020 Yibai Zhang
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; If not, see <https://www.gnu.org/licenses/>
+*/
+
+#ifndef OBS_SSP_SSP_SHM_RING_H
+#define OBS_SSP_SSP_SHM_RING_H
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+#include <ssp_connector_shm.h>
+#include "ssp-buffer-pool.h"
+
+/* The plugin end of a connector's shm ring. Records are not copied out:
+ * Wrap() hands each one downstream as an SSPBuffer pointing into the ring.
+ * They may be released in any order, the producer only gets space back up to
+ * the oldest record still referenced. The mapping lives until both the
+ * connector and the last record are done with it. */
+class SSPShmRing {
+public:
+	static SSPShmRing *Create(size_t size);
+
+	int fd() const { return mapFd; }
+	size_t size() const { return mapSize; }
+
+	SSPBuffer *Wrap(const ShmDataRef *ref);
+
+	void addRef() { refs.fetch_add(1, std::memory_order_relaxed); }
+	void release();
+
+private:
+	struct Slot : SSPBuffer {
+		uint64_t end;
+		bool done;
+	};
+
+	SSPShmRing(ShmRingHeader *header, size_t size, int fd);
+	~SSPShmRing();
+
+	static void Dispose(SSPBuffer *buf);
+	void Done(Slot *slot);
+
+	ShmRingHeader *header;
+	size_t mapSize;
+	int mapFd;
+	std::atomic<int> refs;
+
+	std::mutex lock;
+	std::deque<Slot> records;
+	uint64_t tail;
+};
+
+#endif //OBS_SSP_SSP_SHM_RING_H
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015-2022, Yibai Zhang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ * 3.  Neither the name of Yibai Zhang, obs-ssp, ssp_connector
+ *     nor the names contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Before/after numbers for the pipe path of the connector: synthetic frames
+ * are sent both the old way, copied into one malloc'd message and written
+ * with fwrite, and through msg_writev as the connector does now. A thread
+ * drains the other end of the pipe, like the plugin would.
+ *
+ *   ssp-connector-bench [frames] [frame bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "../ssp_connector_proto.h"
+#include "../ssp_connector_io.h"
+
+// the connector before gathered writes: one copy per frame, then fwrite
+static int old_msg_write(char *buf, size_t size)
+{
+	size_t writed = fwrite(buf, 1, size, stdout);
+	fflush(stdout);
+	if (ferror(stdout)) {
+		log_conn("ferror on msg_write");
+		return -1;
+	}
+	return writed;
+}
+
+static bool old_msg_send(MessageType type, const void *head, size_t head_len,
+			 const void *body, size_t body_len)
+{
+	size_t len = sizeof(Message) + head_len + body_len;
+	auto *msg = (Message *)malloc(len);
+	msg->type = type;
+	msg->length = head_len + body_len;
+	memcpy(msg->value, head, head_len);
+	memcpy(msg->value + head_len, body, body_len);
+	int sz = old_msg_write((char *)msg, len);
+	free(msg);
+	return sz == (int)len;
+}
+
+static bool new_msg_send(MessageType type, const void *head, size_t head_len,
+			 const void *body, size_t body_len)
+{
+	size_t len = sizeof(Message) + head_len + body_len;
+	Message msg;
+	msg.type = type;
+	msg.length = head_len + body_len;
+	msg_iov iov[] = {{&msg, sizeof(msg)},
+			 {head, head_len},
+			 {body, body_len}};
+	return msg_writev(iov, 3) == (int)len;
+}
+
+static double cpu_ms(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+	       (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+static double wall_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+typedef bool (*send_func)(MessageType, const void *, size_t, const void *,
+			  size_t);
+
+static void run(const char *name, send_func send, int frames,
+		const std::vector<uint8_t> &payload)
+{
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	dup2(fds[1], STDOUT_FILENO);
+	close(fds[1]);
+
+	std::thread reader([fd = fds[0]]() {
+		std::vector<uint8_t> buf(1024 * 1024);
+		while (read(fd, buf.data(), buf.size()) > 0) {
+		}
+	});
+
+	VideoData video = {};
+	video.len = payload.size();
+	double wall = wall_ms(), cpu = cpu_ms();
+	for (int i = 0; i < frames; ++i) {
+		video.frm_no = i;
+		if (!send(VideoDataMsg, &video, sizeof(video), payload.data(),
+			  payload.size())) {
+			fprintf(stderr, "%s: write failed\n", name);
+			exit(1);
+		}
+	}
+	fflush(stdout);
+	wall = wall_ms() - wall;
+	cpu = cpu_ms() - cpu;
+
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	reader.join();
+	close(fds[0]);
+
+	double mbit = (double)frames * payload.size() * 8 / 1e6;
+	fprintf(stderr,
+		"%-10s %d frames of %zu bytes: %.1f ms, %.1f Mbit/s, "
+		"%.2f us/frame, %.3f cpu ms/Mbit\n",
+		name, frames, payload.size(), wall, mbit * 1000.0 / wall,
+		wall * 1000.0 / frames, cpu / mbit);
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 20000;
+	size_t size = argc > 2 ? strtoul(argv[2], NULL, 0) : 150 * 1024;
+	std::vector<uint8_t> payload(size);
+	for (size_t i = 0; i < size; ++i) {
+		payload[i] = (uint8_t)(i * 31);
+	}
+
+	// warm up the pipe and the allocator before measuring
+	run("warmup", new_msg_send, frames / 10 + 1, payload);
+	run("msg_write", old_msg_send, frames, payload);
+	run("msg_writev", new_msg_send, frames, payload);
+	return 0;
+}
@@ -30,43 +30,219 @@
 #include <string.h>
 #include <stdlib.h>
 #include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <time.h>
 
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
 #endif
 
+#include <functional>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
 #include <imf/ssp/sspclient.h>
 #include <imf/net/threadloop.h>
 
 #include "main.h"
 #include "ssp_connector_proto.h"
+#include "ssp_connector_shm.h"
+#include "ssp_connector_nal.h"
+#include "ssp_connector_io.h"
 
 char address[256] = {0};
 unsigned int port = 0;
 char uuid[64] = {0};
+int shm_fd = -1;
+size_t shm_size = 0;
+long long ctrl_fd = -1;
+bool mux = false;
+int stream_style = 0;
+bool audio_only = false;
+
+/* One camera. Without --mux there is a single stream, id 0, built from
+ * --host/--port; with --mux streams come and go over the control pipe. */
+struct Stream {
+	uint32_t id;
+	imf::SspClient *client;
+	bool hevc;
+	bool audioOnly;
+	// flow control, only when the plugin asked for a credit window
+	uint32_t window;
+	uint32_t credits;
+	bool waitKeyframe;
+	uint64_t dropped;
+};
 
-imf::SspClient *gSspClient = nullptr;
 imf::Loop *gLoop = nullptr;
+ShmRingHeader *gRing = nullptr;
+std::map<uint32_t, Stream *> gStreams;
+
+using namespace std::placeholders;
+
+struct msg_stats {
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t copied;
+	uint64_t dropped;
+} gStats;
+
+static bool shm_setup(void)
+{
+#ifdef __linux__
+	if (shm_fd < 0) {
+		return false;
+	}
+	void *map = mmap(nullptr, shm_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	shm_fd = -1;
+	if (map == MAP_FAILED) {
+		log_conn("mmap shm ring failed, fallback to pipe.");
+		return false;
+	}
+	gRing = (ShmRingHeader *)map;
+	if (!shm_ring_valid(gRing, shm_size)) {
+		log_conn("invalid shm ring header, fallback to pipe.");
+		munmap(map, shm_size);
+		gRing = nullptr;
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
 
-int msg_write(char *buf, size_t size)
+static void shm_teardown(void)
 {
-	Message *msg = (Message *)buf;
-	size_t writed = 0, cur = 0;
-	//log_conn("send msg type: %d, size %d", msg->type, msg->length);
-	writed = fwrite(buf, 1, size, stdout);
-	fflush(stdout);
-	if (ferror(stdout)) {
-		log_conn("ferror on msg_write");
+#ifdef __linux__
+	if (gRing) {
+		munmap((void *)gRing, shm_size);
+		gRing = nullptr;
+	}
+#endif
+}
+
+/* Write a message of a stream, in mux mode prefixed with its MuxHeader. */
+static int msg_post(uint32_t stream_id, const msg_iov *iov, int count)
+{
+	if (!mux) {
+		return msg_writev(iov, count);
+	}
+	MuxHeader header;
+	header.stream_id = stream_id;
+	msg_iov vec[MSG_IOV_MAX];
+	vec[0] = {&header, sizeof(header)};
+	int n = 1;
+	for (int i = 0; i < count && n < MSG_IOV_MAX; ++i) {
+		vec[n++] = iov[i];
+	}
+	int sz = msg_writev(vec, n);
+	return sz < 0 ? sz : sz - (int)sizeof(header);
+}
+
+static int msg_post(uint32_t stream_id, const void *buf, size_t size)
+{
+	msg_iov iov = {buf, size};
+	return msg_post(stream_id, &iov, 1);
+}
+
+static int msg_write_shm(uint32_t stream_id, MessageType type,
+			 const void *head, size_t head_len, const void *body,
+			 size_t body_len)
+{
+	uint64_t pos;
+	size_t len = sizeof(Message) + head_len + body_len;
+	auto *dst = shm_ring_reserve(gRing, len, &pos);
+	if (!dst) {
 		return -1;
 	}
-	return writed;
+	auto *msg = (Message *)dst;
+	msg->type = type;
+	msg->length = head_len + body_len;
+	memcpy(msg->value, head, head_len);
+	memcpy(msg->value + head_len, body, body_len);
+	shm_ring_commit(gRing, pos, len);
+	gStats.copied += len;
+
+	struct {
+		Message msg;
+		ShmDataRef ref;
+	} bell;
+	bell.msg.type = ShmDataMsg;
+	bell.msg.length = sizeof(ShmDataRef);
+	bell.ref.pos = pos;
+	bell.ref.length = len;
+	if (msg_post(stream_id, &bell, sizeof(bell)) != sizeof(bell)) {
+		return 0;
+	}
+	return len;
+}
+
+/* Send a message made of a fixed header and a payload, through the shm ring
+ * when available, and inline over the pipe otherwise or when it is full. */
+static bool msg_send(uint32_t stream_id, MessageType type, const void *head,
+		     size_t head_len, const void *body, size_t body_len)
+{
+	size_t len = sizeof(Message) + head_len + body_len;
+	gStats.frames++;
+	gStats.bytes += body_len;
+	if (gRing) {
+		int sz = msg_write_shm(stream_id, type, head, head_len, body,
+				       body_len);
+		if (sz >= 0) {
+			return sz == (int)len;
+		}
+	}
+
+	Message msg;
+	msg.type = type;
+	msg.length = head_len + body_len;
+	msg_iov iov[] = {{&msg, sizeof(msg)},
+			 {head, head_len},
+			 {body, body_len}};
+	int sz = msg_post(stream_id, iov, 3);
+	return sz == (int)len;
+}
+
+static void print_stats(void)
+{
+	double cpu_ms = (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+	double mbit = (double)gStats.bytes * 8 / 1000000.0;
+	log_conn("sent %llu frames, dropped %llu without credit, %.1f Mbit, "
+		 "%.1f bytes copied per frame, %.2f cpu ms per Mbit",
+		 (unsigned long long)gStats.frames,
+		 (unsigned long long)gStats.dropped, mbit,
+		 gStats.frames ? (double)gStats.copied / gStats.frames : 0.0,
+		 mbit > 0 ? cpu_ms / mbit : 0.0);
 }
 
 int process_args(int argc, char **argv)
 {
 	int t = 1;
 	while (t < argc) {
+		if (!strcmp(argv[t], "--mux")) {
+			mux = true;
+			++t;
+			continue;
+		}
+		if (!strcmp(argv[t], "--audio-only")) {
+			audio_only = true;
+			++t;
+			continue;
+		}
 		if (t + 1 >= argc) {
 			return -1;
 		}
@@ -81,6 +257,19 @@ int process_args(int argc, char **argv)
 			   !strcmp(argv[t], "--uuid")) {
 			++t;
 			strncpy(uuid, argv[t], sizeof(uuid));
+		} else if (!strcmp(argv[t], "--shm-fd")) {
+			++t;
+			shm_fd = (int)strtol(argv[t], NULL, 0);
+		} else if (!strcmp(argv[t], "--shm-size")) {
+			++t;
+			shm_size = strtoull(argv[t], NULL, 0);
+		} else if (!strcmp(argv[t], "--ctrl-fd")) {
+			++t;
+			ctrl_fd = strtoll(argv[t], NULL, 0);
+		} else if (!strcmp(argv[t], "-s") ||
+			   !strcmp(argv[t], "--stream-style")) {
+			++t;
+			stream_style = (int)strtol(argv[t], NULL, 0);
 		} else {
 			return -1;
 		}
@@ -88,6 +277,9 @@ int process_args(int argc, char **argv)
 		++t;
 	}
 
+	if (mux) {
+		return ctrl_fd < 0 ? -1 : 0;
+	}
 	if (strlen(address) == 0 || port == 0) {
 		return -1;
 	}
@@ -97,68 +289,103 @@ int process_args(int argc, char **argv)
 void print_usage(void)
 {
 	fprintf(stderr,
-		"Usage: ssp_connector --host host --port port [--uuid uuid]");
+		"Usage: ssp_connector --host host --port port [--uuid uuid] "
+		"[--stream-style style] [--audio-only] "
+		"[--shm-fd fd --shm-size size]\n"
+		"       ssp_connector --mux --ctrl-fd fd "
+		"[--shm-fd fd --shm-size size]");
+}
+
+static void stop_all(void)
+{
+	for (auto &it : gStreams) {
+		it.second->client->stop();
+	}
+	gLoop->quit();
 }
 
-static void on_general_message(MessageType type)
+// the plugin is gone when we can no longer write to it, nothing left to do
+static void on_write_failed(void)
+{
+	log_conn("stopped.");
+	stop_all();
+}
+
+static void on_general_message(Stream *stream, MessageType type)
 {
 	Message msg;
 	msg.length = 0;
 	msg.type = type;
-	int sz = msg_write((char *)&msg, sizeof(msg));
+	int sz = msg_post(stream->id, &msg, sizeof(msg));
 	if (sz != sizeof(msg)) {
-		log_conn("stopped.");
-		gSspClient->stop();
-		gLoop->quit();
+		on_write_failed();
 	}
 }
 
-static void on_video(imf::SspH264Data *video)
+/* Out of credits the plugin could not queue the frame anyway, so drop it here
+ * before it costs a copy and pipe bandwidth. Once a reference frame is
+ * dropped nothing decodes cleanly up to the next keyframe, so skip to it. */
+static bool credit_take(Stream *stream, uint32_t flags)
 {
-	size_t len = sizeof(Message) + sizeof(VideoData) + video->len;
-	auto *msg = (Message *)malloc(len);
-	msg->type = VideoDataMsg;
-	msg->length = sizeof(VideoData) + video->len;
-	auto *videoData = (VideoData *)msg->value;
-	videoData->frm_no = video->frm_no;
-	videoData->ntp_timestamp = video->ntp_timestamp;
-	videoData->pts = video->pts;
-	videoData->type = video->type;
-	videoData->len = video->len;
-	memcpy(videoData->data, video->data, video->len);
-	int sz = msg_write((char *)msg, len);
-	free(msg);
-	if (sz != len) {
-		log_conn("stopped.");
-		gSspClient->stop();
-		gLoop->quit();
+	if (!stream->window) {
+		return true;
+	}
+	if (stream->waitKeyframe && !(flags & SSP_NAL_FLAG_KEYFRAME)) {
+		return false;
+	}
+	if (stream->credits == 0) {
+		if (flags & SSP_NAL_FLAG_REFERENCE) {
+			stream->waitKeyframe = true;
+		}
+		return false;
 	}
+	stream->waitKeyframe = false;
+	stream->credits--;
+	return true;
 }
 
-static void on_audio(imf::SspAudioData *audio)
+static void on_video(Stream *stream, imf::SspH264Data *video)
 {
-	size_t len = sizeof(Message) + sizeof(AudioData) + audio->len;
-	auto *msg = (Message *)malloc(len);
-	msg->type = AudioDataMsg;
-	msg->length = sizeof(AudioData) + audio->len;
-	auto *audioData = (AudioData *)msg->value;
-	audioData->ntp_timestamp = audio->ntp_timestamp;
-	audioData->pts = audio->pts;
-	audioData->len = audio->len;
-	memcpy(audioData->data, audio->data, audio->len);
-
-	int sz = msg_write((char *)msg, len);
-	free(msg);
-	if (sz != len) {
-		log_conn("stopped.");
-		gSspClient->stop();
-		gLoop->quit();
+	if (stream->audioOnly) {
+		// never crosses the pipe, the plugin has no video decoder
+		return;
+	}
+	VideoData videoData;
+	// the only place the bitstream is parsed, the plugin uses the index
+	videoData.flags = ssp_nal_scan(video->data, video->len, stream->hevc,
+				       &videoData.nal);
+	if (!credit_take(stream, videoData.flags)) {
+		stream->dropped++;
+		gStats.dropped++;
+		return;
+	}
+	videoData.frm_no = video->frm_no;
+	videoData.ntp_timestamp = video->ntp_timestamp;
+	videoData.pts = video->pts;
+	videoData.type = video->type;
+	videoData.len = video->len;
+	if (!msg_send(stream->id, VideoDataMsg, &videoData, sizeof(videoData),
+		      video->data, video->len)) {
+		on_write_failed();
 	}
 }
-static void on_meta(imf::SspVideoMeta *vmeta, struct imf::SspAudioMeta *ameta,
-		    struct imf::SspMeta *meta)
+
+static void on_audio(Stream *stream, imf::SspAudioData *audio)
+{
+	AudioData audioData;
+	audioData.ntp_timestamp = audio->ntp_timestamp;
+	audioData.pts = audio->pts;
+	audioData.len = audio->len;
+	if (!msg_send(stream->id, AudioDataMsg, &audioData, sizeof(audioData),
+		      audio->data, audio->len)) {
+		on_write_failed();
+	}
+}
+static void on_meta(Stream *stream, imf::SspVideoMeta *vmeta,
+		    struct imf::SspAudioMeta *ameta, struct imf::SspMeta *meta)
 {
 	size_t len = sizeof(Message) + sizeof(Metadata);
+	stream->hevc = vmeta->encoder == VIDEO_ENCODER_H265;
 	auto *msg = (Message *)malloc(len);
 	msg->type = MetaDataMsg;
 	msg->length = sizeof(Metadata);
@@ -182,15 +409,14 @@ static void on_meta(imf::SspVideoMeta *vmeta, struct imf::SspAudioMeta *ameta,
 	metadata->meta.tc_drop_frame = meta->tc_drop_frame;
 	metadata->meta.timecode = meta->timecode;
 
-	int sz = msg_write((char *)msg, len);
+	int sz = msg_post(stream->id, msg, len);
 	free(msg);
 	if (sz != len) {
 		log_conn("stopped sz != len %d != %d.", sz, len);
-		gSspClient->stop();
-		gLoop->quit();
+		on_write_failed();
 	}
 }
-static void on_exception(int code, const char *description)
+static void on_exception(Stream *stream, int code, const char *description)
 {
 	size_t len =
 		sizeof(Message) + sizeof(Message) + strlen(description) + 1;
@@ -201,45 +427,230 @@ static void on_exception(int code, const char *description)
 	errmsg->length = strlen(description) + 1;
 	errmsg->type = code;
 	strcpy((char *)errmsg->value, description);
-	int sz = msg_write((char *)msg, len);
+	int sz = msg_post(stream->id, msg, len);
 	free(msg);
 	if (sz != len) {
 		log_conn("exception error.");
 	}
-	gSspClient->stop();
-	gLoop->quit();
+	stream->client->stop();
+	// in mux mode the plugin closes the stream, other cameras go on
+	if (!mux) {
+		gLoop->quit();
+	}
 }
 
-static void setup(imf::Loop *loop)
+static void on_disconnected(Stream *stream)
 {
-	auto client = new imf::SspClient(address, loop, 0x400000, port, 0);
+	on_general_message(stream, DisconnectMsg);
+	stream->client->stop();
+	if (!mux) {
+		gLoop->quit();
+	}
+}
+
+static Stream *stream_open(uint32_t id, const char *host, unsigned int port,
+			   size_t buffer_size, uint32_t window, int style,
+			   bool audioOnly)
+{
+	auto stream = new Stream;
+	auto client =
+		new imf::SspClient(host, gLoop, buffer_size, port, style);
+	stream->id = id;
+	stream->client = client;
+	stream->hevc = false;
+	stream->audioOnly = audioOnly;
+	stream->window = window;
+	stream->credits = window;
+	stream->waitKeyframe = false;
+	stream->dropped = 0;
 	client->init();
-	gSspClient = client;
+	gStreams[id] = stream;
 
-	client->setOnH264DataCallback(on_video);
-	client->setOnMetaCallback(on_meta);
-	client->setOnAudioDataCallback(on_audio);
-	client->setOnExceptionCallback(on_exception);
+	client->setOnH264DataCallback(std::bind(on_video, stream, _1));
+	client->setOnMetaCallback(std::bind(on_meta, stream, _1, _2, _3));
+	client->setOnAudioDataCallback(std::bind(on_audio, stream, _1));
+	client->setOnExceptionCallback(std::bind(on_exception, stream, _1, _2));
 	client->setOnConnectionConnectedCallback(
-		std::bind(on_general_message, ConnectionConnectedMsg));
+		std::bind(on_general_message, stream, ConnectionConnectedMsg));
 	client->setOnRecvBufferFullCallback(
-		std::bind(on_general_message, RecvBufferFullMsg));
-	client->setOnDisconnectedCallback([=]() {
-		on_general_message(DisconnectMsg);
-		client->stop();
-		loop->quit();
-	});
+		std::bind(on_general_message, stream, RecvBufferFullMsg));
+	client->setOnDisconnectedCallback(std::bind(on_disconnected, stream));
 	client->start();
+	return stream;
+}
+
+/* libssp closes the handles of a stopped client asynchronously, their close
+ * callbacks still use it. A closed stream is kept here and freed a while
+ * later by gReapTimer, once the loop has run those callbacks; the delay also
+ * covers a socket shutdown still in flight. */
+#define STREAM_REAP_DELAY_MS 100
+
+static std::vector<Stream *> gRetired;
+static uv_timer_t gReapTimer;
+static bool gReapTimerReady = false;
+
+static void stream_free(Stream *stream)
+{
+	delete stream->client;
+	delete stream;
+}
+
+static void stream_reap(uv_timer_t *timer)
+{
+	for (auto stream : gRetired) {
+		stream_free(stream);
+	}
+	gRetired.clear();
+}
+
+static void stream_close(uint32_t id)
+{
+	auto it = gStreams.find(id);
+	if (it == gStreams.end()) {
+		return;
+	}
+	auto stream = it->second;
+	gStreams.erase(it);
+	if (stream->dropped) {
+		log_conn("stream %u dropped %llu frames without credit", id,
+			 (unsigned long long)stream->dropped);
+	}
+	stream->client->stop();
+	gRetired.push_back(stream);
+	// restarted by every close, so the last one gets the full delay too
+	if (gReapTimerReady) {
+		uv_timer_start(&gReapTimer, stream_reap, STREAM_REAP_DELAY_MS,
+			       0);
+	}
+}
+
+static void ctrl_handle(const Message *msg)
+{
+	switch (msg->type) {
+	case CtrlOpenMsg: {
+		if (msg->length != sizeof(ControlOpen)) {
+			break;
+		}
+		auto open = (const ControlOpen *)msg->value;
+		char host[SSP_MUX_HOST_MAX];
+		memcpy(host, open->host, sizeof(host));
+		host[sizeof(host) - 1] = '\0';
+		if (open->stream_id == SSP_MUX_CONNECTOR_STREAM ||
+		    gStreams.count(open->stream_id)) {
+			log_conn("stream %u already open", open->stream_id);
+			break;
+		}
+		log_conn("open stream %u: %s:%u", open->stream_id, host,
+			 open->port);
+		stream_open(open->stream_id, host, open->port,
+			    open->buffer_size ? open->buffer_size : 0x400000,
+			    open->credit_window, (int)open->stream_style,
+			    open->flags & SSP_OPEN_AUDIO_ONLY);
+		return;
+	}
+	case CtrlCreditMsg: {
+		if (msg->length != sizeof(ControlCredit)) {
+			break;
+		}
+		auto credit = (const ControlCredit *)msg->value;
+		auto it = gStreams.find(credit->stream_id);
+		if (it != gStreams.end() && it->second->window) {
+			auto stream = it->second;
+			stream->credits = std::min<uint64_t>(
+				(uint64_t)stream->credits + credit->credits,
+				stream->window);
+		}
+		return;
+	}
+	case CtrlCloseMsg: {
+		if (msg->length != sizeof(ControlClose)) {
+			break;
+		}
+		auto close = (const ControlClose *)msg->value;
+		log_conn("close stream %u", close->stream_id);
+		stream_close(close->stream_id);
+		return;
+	}
+	default:
+		break;
+	}
+	log_conn("bad control message, type: %u, length: %u", msg->type,
+		 msg->length);
+}
+
+static uv_pipe_t gCtrlPipe;
+static std::string gCtrlBuf;
+
+static void ctrl_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf)
+{
+	static char slab[4096];
+	buf->base = slab;
+	buf->len = sizeof(slab);
+}
+
+static void ctrl_read(uv_stream_t *pipe, ssize_t nread, const uv_buf_t *buf)
+{
+	if (nread < 0) {
+		// the plugin closed its end, it does not want anything anymore
+		log_conn("control pipe closed: %s", uv_strerror((int)nread));
+		uv_read_stop(pipe);
+		uv_close((uv_handle_t *)pipe, nullptr);
+		stop_all();
+		return;
+	}
+	gCtrlBuf.append(buf->base, nread);
+	size_t pos = 0;
+	while (gCtrlBuf.size() - pos >= sizeof(Message)) {
+		auto msg = (const Message *)(gCtrlBuf.data() + pos);
+		size_t len = sizeof(Message) + msg->length;
+		if (gCtrlBuf.size() - pos < len) {
+			break;
+		}
+		ctrl_handle(msg);
+		pos += len;
+	}
+	gCtrlBuf.erase(0, pos);
+}
+
+static bool ctrl_setup(imf::Loop *loop)
+{
+#ifdef _WIN32
+	// on Windows the plugin hands us an inheritable pipe HANDLE
+	int fd = _open_osfhandle((intptr_t)ctrl_fd, _O_RDONLY | _O_BINARY);
+#else
+	int fd = (int)ctrl_fd;
+#endif
+	auto uvLoop = (uv_loop_t *)loop->getLoop();
+	if (fd < 0 || uv_pipe_init(uvLoop, &gCtrlPipe, 0) ||
+	    uv_pipe_open(&gCtrlPipe, fd)) {
+		log_conn("cannot open control pipe %lld", ctrl_fd);
+		return false;
+	}
+	uv_read_start((uv_stream_t *)&gCtrlPipe, ctrl_alloc, ctrl_read);
+	gReapTimerReady = uv_timer_init(uvLoop, &gReapTimer) == 0;
+	return true;
+}
+
+static void setup(imf::Loop *loop)
+{
+	uint32_t id = SSP_MUX_CONNECTOR_STREAM;
+	if (mux) {
+		if (!ctrl_setup(loop)) {
+			loop->quit();
+			return;
+		}
+	} else {
+		stream_open(id, address, port, 0x400000, 0, stream_style,
+			    audio_only);
+	}
 
 	Message msg;
 	msg.length = 0;
 	msg.type = ConnectorOkMsg;
-	int sz = msg_write((char *)&msg, sizeof(msg));
+	int sz = msg_post(id, &msg, sizeof(msg));
 
 	if (sz != sizeof(msg)) {
-		log_conn("stopped.");
-		client->stop();
-		gLoop->quit();
+		on_write_failed();
 	}
 }
 
@@ -256,16 +667,27 @@ int main(int argc, char **argv)
 	setvbuf(stdout, NULL, _IONBF, 0);
 	//setbuf(stdout, nullptr); // unbuffered stdout
 
-	log_conn("host: %s\nport: %d\nuuid: %s\n", address, port, uuid);
+	if (mux) {
+		log_conn("mux mode, control fd: %lld\n", ctrl_fd);
+	} else {
+		log_conn("host: %s\nport: %d\nuuid: %s\n", address, port, uuid);
+	}
+	if (shm_setup()) {
+		log_conn("using shm ring transport, size: %zu", shm_size);
+	}
 	auto loop = new imf::Loop();
 	loop->init();
 	gLoop = loop;
 	setup(gLoop);
 	loop->loop();
 	log_conn("loop finished");
+	print_stats();
 	delete loop;
-	if (gSspClient) {
-		delete gSspClient;
+	for (auto &it : gStreams) {
+		stream_free(it.second);
 	}
+	gStreams.clear();
+	stream_reap(nullptr);
+	shm_teardown();
 	return 0;
 }
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2015-2022, Yibai Zhang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ * 3.  Neither the name of Yibai Zhang, obs-ssp, ssp_connector
+ *     nor the names contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSP_CONNECTOR_IO_H_
+#define SSP_CONNECTOR_IO_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+#include "main.h"
+
+#define MSG_IOV_MAX 5
+
+struct msg_iov {
+	const void *base;
+	size_t len;
+};
+
+/* Gathered write of a message, the payload is written straight from the
+ * buffer owned by libssp without being copied into a message buffer. */
+static inline int msg_writev(const msg_iov *iov, int count)
+{
+	size_t writed = 0;
+#ifdef _WIN32
+	for (int i = 0; i < count; ++i) {
+		if (!iov[i].len) {
+			continue;
+		}
+		writed += fwrite(iov[i].base, 1, iov[i].len, stdout);
+		if (ferror(stdout)) {
+			log_conn("ferror on msg_writev");
+			return -1;
+		}
+	}
+#else
+	struct iovec vec[MSG_IOV_MAX];
+	int n = 0;
+	for (int i = 0; i < count && n < MSG_IOV_MAX; ++i) {
+		if (!iov[i].len) {
+			continue;
+		}
+		vec[n].iov_base = (void *)iov[i].base;
+		vec[n].iov_len = iov[i].len;
+		++n;
+	}
+	struct iovec *cur = vec;
+	while (n > 0) {
+		ssize_t ret = writev(STDOUT_FILENO, cur, n);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_conn("writev error on msg_writev: %d", errno);
+			return -1;
+		}
+		writed += ret;
+		// partial write, skip what the pipe already took
+		while (n > 0 && (size_t)ret >= cur->iov_len) {
+			ret -= cur->iov_len;
+			++cur;
+			--n;
+		}
+		if (n > 0) {
+			cur->iov_base = (uint8_t *)cur->iov_base + ret;
+			cur->iov_len -= ret;
+		}
+	}
+#endif
+	return writed;
+}
+
+#endif
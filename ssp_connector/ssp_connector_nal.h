@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2015-2022, Yibai Zhang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ * 3.  Neither the name of Yibai Zhang, obs-ssp, ssp_connector
+ *     nor the names contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSP_CONNECTOR_NAL_H_
+#define SSP_CONNECTOR_NAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "ssp_connector_proto.h"
+
+#define SSP_NAL_FLAG_KEYFRAME 0x01
+#define SSP_NAL_FLAG_REFERENCE 0x02
+#define SSP_NAL_FLAG_PARAMSET 0x04
+#define SSP_NAL_FLAG_SEI 0x08
+
+static inline const uint8_t *ssp_nal_find_startcode(const uint8_t *p,
+						    const uint8_t *end)
+{
+	while (p + 3 <= end) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+			return p + 3;
+		}
+		++p;
+	}
+	return end;
+}
+
+// FNV-1a, to notice parameter sets changing without keeping them around
+static inline uint32_t ssp_nal_hash(uint32_t hash, const uint8_t *p,
+				    const uint8_t *end)
+{
+	// the zero of a four byte start code belongs to the next unit
+	while (end > p && end[-1] == 0) {
+		--end;
+	}
+	while (p < end) {
+		hash = (hash ^ *p++) * 16777619u;
+	}
+	return hash;
+}
+
+/* Walk the annex-b NAL units of an access unit and classify the picture:
+ * whether it is a keyframe (IDR/IRAP), and whether other pictures may
+ * reference it (nal_ref_idc for H.264, the sub-layer non-reference VCL
+ * types for HEVC). Dropping a non-reference picture never corrupts the
+ * pictures after it. Parameter sets and SEI come before the first VCL unit
+ * of an access unit, and all slices of a picture share its properties, so
+ * the scan stops at the first VCL unit instead of walking the slice data.
+ * When index is given, the units seen and a hash of the parameter sets are
+ * recorded in it. */
+static inline uint32_t ssp_nal_scan(const uint8_t *data, size_t size,
+				    bool hevc, struct NalIndex *index)
+{
+	const uint8_t *end = data + size;
+	const uint8_t *nal = ssp_nal_find_startcode(data, end);
+	uint32_t flags = 0;
+	uint32_t ps_hash = 2166136261u;
+	bool has_vcl = false;
+
+	if (index) {
+		index->count = 0;
+		index->ps_hash = 0;
+	}
+
+	while (nal < end && !has_vcl) {
+		const uint8_t *next = ssp_nal_find_startcode(nal, end);
+		bool paramset = false;
+		uint8_t type;
+		if (hevc) {
+			type = (nal[0] >> 1) & 0x3f;
+			if (type <= 31) {
+				has_vcl = true;
+				if (type >= 16 && type <= 23) {
+					flags |= SSP_NAL_FLAG_KEYFRAME;
+				}
+				// types 0, 2, ... 14 are sub-layer non-reference
+				if (type > 14 || (type & 1)) {
+					flags |= SSP_NAL_FLAG_REFERENCE;
+				}
+			} else if (type >= 32 && type <= 34) {
+				paramset = true;
+			} else if (type == 39 || type == 40) {
+				flags |= SSP_NAL_FLAG_SEI;
+			}
+		} else {
+			type = nal[0] & 0x1f;
+			uint8_t ref_idc = (nal[0] >> 5) & 0x03;
+			if (type >= 1 && type <= 5) {
+				has_vcl = true;
+				if (type == 5) {
+					flags |= SSP_NAL_FLAG_KEYFRAME;
+				}
+				if (ref_idc) {
+					flags |= SSP_NAL_FLAG_REFERENCE;
+				}
+			} else if (type == 7 || type == 8) {
+				paramset = true;
+			} else if (type == 6) {
+				flags |= SSP_NAL_FLAG_SEI;
+			}
+		}
+		if (paramset) {
+			flags |= SSP_NAL_FLAG_PARAMSET;
+			ps_hash = ssp_nal_hash(ps_hash, nal,
+					       next < end ? next - 3 : end);
+		}
+		if (index && index->count < SSP_NAL_INDEX_MAX) {
+			index->units[index->count].offset =
+				(uint32_t)(nal - data);
+			index->units[index->count].type = type;
+			index->count++;
+		}
+		nal = next;
+	}
+
+	// nothing recognizable, be conservative and never drop it
+	if (!has_vcl) {
+		flags |= SSP_NAL_FLAG_REFERENCE;
+	}
+	if (index && (flags & SSP_NAL_FLAG_PARAMSET)) {
+		index->ps_hash = ps_hash;
+	}
+	return flags;
+}
+
+#endif
@@ -66,11 +66,28 @@ struct SSP_PROTO Metadata {
 	struct AudioMeta ameta;
 };
 
+#define SSP_NAL_INDEX_MAX 8
+
+struct SSP_PROTO NalUnit {
+	uint32_t offset; // of the NAL header, right after the start code
+	uint8_t type;
+};
+
+/* The NAL units of a frame up to its first slice, filled once by
+ * ssp_nal_scan where the frame enters the pipeline. */
+struct SSP_PROTO NalIndex {
+	uint32_t ps_hash; // of the parameter sets, 0 when the frame has none
+	uint8_t count;
+	struct NalUnit units[SSP_NAL_INDEX_MAX];
+};
+
 struct SSP_PROTO VideoData {
 	uint64_t pts;
 	uint64_t ntp_timestamp;
 	uint32_t frm_no;
 	uint32_t type; // I or P
+	uint32_t flags; // SSP_NAL_FLAG_*
+	struct NalIndex nal;
 	size_t len;
 	uint8_t data[0];
 };
@@ -91,6 +108,7 @@ enum MessageType {
 	ConnectionConnectedMsg,
 	ExceptionMsg,
 	ConnectorOkMsg,
+	ShmDataMsg,
 };
 
 struct Message {
@@ -99,6 +117,55 @@ struct Message {
 	uint8_t value[0];
 };
 
+// value of ShmDataMsg, the referenced record lives in the shared memory ring
+struct SSP_PROTO ShmDataRef {
+	uint64_t pos;
+	uint32_t length;
+};
+
+/* Mux mode (--mux), one connector serves many cameras. Every message on
+ * stdout is preceded by a MuxHeader naming the stream it belongs to, stream
+ * 0 is the connector itself. Streams are opened and closed with control
+ * messages, framed as Message, on the --ctrl-fd pipe. */
+#define SSP_MUX_CONNECTOR_STREAM 0
+#define SSP_MUX_HOST_MAX 256
+
+struct SSP_PROTO MuxHeader {
+	uint32_t stream_id;
+};
+
+enum ControlType {
+	CtrlOpenMsg = 1,
+	CtrlCloseMsg,
+	CtrlCreditMsg,
+};
+
+// ControlOpen flags: video is dropped in the connector, only audio is sent
+#define SSP_OPEN_AUDIO_ONLY 0x01
+
+/* credit_window is how many video frames may be in flight to the plugin, 0
+ * for no flow control. Each frame sent takes a credit, the plugin returns
+ * them with CtrlCreditMsg as it consumes frames. stream_style is the
+ * libssp STREAM_DEFAULT/STREAM_MAIN/STREAM_SEC to ask the camera for. */
+struct SSP_PROTO ControlOpen {
+	uint32_t stream_id;
+	uint32_t port;
+	uint32_t buffer_size;
+	uint32_t credit_window;
+	uint32_t stream_style;
+	uint32_t flags;
+	char host[SSP_MUX_HOST_MAX];
+};
+
+struct SSP_PROTO ControlClose {
+	uint32_t stream_id;
+};
+
+struct SSP_PROTO ControlCredit {
+	uint32_t stream_id;
+	uint32_t credits;
+};
+
 #pragma pack()
 
 #endif
\ No newline at end of file
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2015-2022, Yibai Zhang
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1.  Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ * 2.  Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the documentation
+ *     and/or other materials provided with the distribution.
+ * 3.  Neither the name of Yibai Zhang, obs-ssp, ssp_connector
+ *     nor the names contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSP_CONNECTOR_SHM_H_
+#define SSP_CONNECTOR_SHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+#include "ssp_connector_proto.h"
+
+/*
+ * Shared memory ring between ssp-connector (single producer) and the plugin
+ * (single consumer). Each record is a complete Message; the pipe only carries
+ * a ShmDataMsg doorbell pointing at it, so ordering is still defined by the
+ * pipe. Positions are monotonic byte counters, a record never wraps: if it
+ * does not fit at the end of the buffer the tail is skipped. Every record is
+ * followed by SSP_SHM_PADDING zeroed bytes, so the plugin can decode frames
+ * in place.
+ */
+
+#define SSP_SHM_MAGIC 0x52505353 // "SSPR"
+#define SSP_SHM_VERSION 2
+#define SSP_SHM_ALIGN 64
+#define SSP_SHM_PADDING 64
+#define SSP_SHM_DEFAULT_SIZE (32 * 1024 * 1024)
+
+struct ShmRingHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	alignas(SSP_SHM_ALIGN) std::atomic<uint64_t> write_pos;
+	alignas(SSP_SHM_ALIGN) std::atomic<uint64_t> read_pos;
+};
+
+static inline uint64_t shm_ring_align(uint64_t size)
+{
+	return (size + SSP_SHM_ALIGN - 1) & ~(uint64_t)(SSP_SHM_ALIGN - 1);
+}
+
+// ring space taken by a record of size bytes
+static inline uint64_t shm_ring_record(uint64_t size)
+{
+	return shm_ring_align(size + SSP_SHM_PADDING);
+}
+
+static inline uint8_t *shm_ring_data(ShmRingHeader *ring)
+{
+	return (uint8_t *)ring + sizeof(ShmRingHeader);
+}
+
+static inline size_t shm_ring_capacity(size_t map_size)
+{
+	return (size_t)(map_size - sizeof(ShmRingHeader)) &
+	       ~(size_t)(SSP_SHM_ALIGN - 1);
+}
+
+static inline bool shm_ring_init(ShmRingHeader *ring, size_t map_size)
+{
+	if (map_size <= sizeof(ShmRingHeader) + SSP_SHM_ALIGN) {
+		return false;
+	}
+	ring->magic = SSP_SHM_MAGIC;
+	ring->version = SSP_SHM_VERSION;
+	ring->capacity = shm_ring_capacity(map_size);
+	ring->write_pos.store(0, std::memory_order_relaxed);
+	ring->read_pos.store(0, std::memory_order_relaxed);
+	return true;
+}
+
+static inline bool shm_ring_valid(ShmRingHeader *ring, size_t map_size)
+{
+	return ring->magic == SSP_SHM_MAGIC &&
+	       ring->version == SSP_SHM_VERSION &&
+	       ring->capacity == shm_ring_capacity(map_size);
+}
+
+/* Producer side. Returns nullptr if the ring is full, the caller is expected
+ * to fall back to sending the message inline over the pipe. */
+static inline uint8_t *shm_ring_reserve(ShmRingHeader *ring, size_t size,
+					uint64_t *pos)
+{
+	uint64_t need = shm_ring_record(size);
+	uint64_t cap = ring->capacity;
+	if (need > cap) {
+		return nullptr;
+	}
+	uint64_t wpos = ring->write_pos.load(std::memory_order_relaxed);
+	uint64_t off = wpos % cap;
+	if (off + need > cap) {
+		wpos += cap - off;
+		off = 0;
+	}
+	uint64_t rpos = ring->read_pos.load(std::memory_order_acquire);
+	if (wpos + need - rpos > cap) {
+		return nullptr;
+	}
+	*pos = wpos;
+	return shm_ring_data(ring) + off;
+}
+
+static inline void shm_ring_commit(ShmRingHeader *ring, uint64_t pos,
+				   size_t size)
+{
+	uint64_t off = pos % ring->capacity;
+	memset(shm_ring_data(ring) + off + size, 0, SSP_SHM_PADDING);
+	ring->write_pos.store(pos + shm_ring_record(size),
+			      std::memory_order_release);
+}
+
+/* Consumer side. The doorbell comes from another process, so check it really
+ * points to a committed record before touching the data. */
+static inline Message *shm_ring_peek(ShmRingHeader *ring,
+				     const ShmDataRef *ref)
+{
+	uint64_t cap = ring->capacity;
+	uint64_t off = ref->pos % cap;
+	uint64_t wpos = ring->write_pos.load(std::memory_order_acquire);
+	uint64_t need = shm_ring_record(ref->length);
+	if (ref->length < sizeof(Message) || off + need > cap ||
+	    ref->pos + need > wpos) {
+		return nullptr;
+	}
+	auto *msg = (Message *)(shm_ring_data(ring) + off);
+	if (sizeof(Message) + (uint64_t)msg->length > ref->length) {
+		return nullptr;
+	}
+	return msg;
+}
+
+/* Records must be released in the order they were written, everything up to
+ * end is given back to the producer. */
+static inline void shm_ring_release(ShmRingHeader *ring, uint64_t end)
+{
+	ring->read_pos.store(end, std::memory_order_release);
+}
+
+#endif